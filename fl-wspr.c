@@ -23,7 +23,6 @@
  * - Amplitude ramps at start and end of transmission to avoid "key clicks"
  * - Noise shaping to push quantization noise away from the operating
  *   frequency, something similar to https://amcinnes.info/2012/uc_am_xmit/
- * - Interpolation of the sine table instead of phase dithering
  * - Try different sample rates and measure how it affects phase noise and
  *   spurs of the PLL that synthesizes the sample rate inside FL2000
  */
@@ -35,23 +34,76 @@
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <complex.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <osmo-fl2k.h>
+#include "wspr_encode.h"
 
 #define FAIL(...) { fprintf(stderr, __VA_ARGS__); goto end; }
 #define INFO(...) { fprintf(stderr, __VA_ARGS__); }
 
-#define SINE_SHIFT 10
-#define SINE_SIZE (1<<SINE_SHIFT)
+/* Range of sine table sizes (bits of phase used) */
+#define SINE_BITS_MIN 8
+#define SINE_BITS_MAX 16
+#define SINE_BITS_DEFAULT 10 // If the cache size is unknown
 
-#define WSPR_LEN 162
 #define MAX_FREQS 16
+#define MAX_MSGS 16
+#define MAX_TONES 64
+
+/* Choice of sample rate per band */
+#define BANDFS_MIN 10e6 // Lowest sample rate used (Hz)
+#define BANDFS_STEP 1e6 // Sample rates tried are multiples of this (Hz)
+#define BANDFS_OS 4.0 // Minimum ratio of sample rate to frequency
+#define BANDFS_SPUR 0.05 // Minimum distance of harmonic aliases from the band
+
+/* Longest carrier period to cache, as a power of 2 samples */
+#define CACHE_SHIFT 24
+
+/* Samples computed at a time into a scratch area before they are
+ * written to the buffers with streaming stores */
+#define NT_BLOCK 4096
 
 struct configuration {
 	uint32_t id;
 	double fs, fs_exact, ppm, p1, p2;
 	const char *s;
-	char ps;
-	unsigned nf;
+	char ps, eq, share, tune;
+	unsigned nf, ch, bench, ns, threads;
+	double snap;
+	char sim;
+	uint64_t seed;
+	const char *out;
+	double noise, nlevel;
+	unsigned tones, slots;
+	char bandfs, stop, nt;
+	double bfs[MAX_FREQS]; // Nominal sample rate for each band
+	double spacing;
+	char dither, poly;
+	unsigned sinebits;
+	char quarter, interp;
+	char combine;
+	double cwg, cwb;
+	const char *cal;
+	double df1, df2, pstep1, pstep2;
+	const char *pfile;
+	char sync;
+	double delay, dphase;
+	const char *steer;
+	int steerdev;
+	const char *synccal;
+	double capfs;
+	const char *m[MAX_MSGS];
+	unsigned nm;
+	char rotate;
+	double duty[MAX_FREQS]; // Percent of slots to transmit on each band
+	unsigned nduty;
 	double f[MAX_FREQS];
 };
 #define CONFIGHELP \
@@ -60,148 +112,2918 @@ struct configuration {
 "fs   Target sample rate for FL2K (Hz)\n" \
 "ppm  Frequency error of FL2K in parts per million\n" \
 "s    WSPR symbols (string of 162 numbers between 0 and 3)\n" \
+"m    WSPR message to encode, \"CALL LOCATOR DBM\" or \"CALL DBM\".\n" \
+"     Compound callsigns and 6-character locators are sent as\n" \
+"     Type 2 and 3 messages in consecutive transmissions. To rotate\n" \
+"     between messages, give multiple m parameters.\n" \
+"rotate Set to 1 to rotate the messages separately on each band\n" \
+"     instead of on every transmission\n" \
 "f    WSPR center frequency (Hz)\n" \
 "     To cycle between multiple bands, give multiple f parameters.\n" \
 "p1   Phase shift for green channel (degrees)\n" \
 "p2   Phase shift for blue channel (degrees)\n" \
 "ps   Set to 1 to swap phase shifts of green and blue channel\n" \
-"     before each transmission"
+"     before each transmission\n" \
+"df1  Frequency offset of green channel (Hz)\n" \
+"df2  Frequency offset of blue channel (Hz)\n" \
+"pstep1 Change of the phase shift of green channel every symbol (degrees)\n" \
+"pstep2 Change of the phase shift of blue channel every symbol (degrees)\n" \
+"pfile File of phase shifts added for each symbol: lines with the shifts\n" \
+"     of green and blue channel (degrees), repeated if fewer than symbols\n" \
+"eq   Set to 1 to equalize the sinc rolloff of the DAC so that\n" \
+"     every band is transmitted at the level of the weakest one\n" \
+"     Frequencies above fs/2 are transmitted on a DAC image,\n" \
+"     e.g. f 144.4901e6 uses the image above 100 MHz.\n" \
+"bandfs Set to 1 to lower the sample rate for each band below fs/4\n" \
+"     to the lowest one that is easy to filter and keeps aliases of\n" \
+"     DAC harmonics away from the band. fs is then the maximum.\n" \
+"sync Set to 1 to start each transmission on the exact sample where the\n" \
+"     slot starts, estimated from the times of the callbacks, so that\n" \
+"     adapters run by several instances with the same clock start together\n" \
+"delay Delay of the start with sync (samples, may be fractional)\n" \
+"dphase Phase shift of all outputs (degrees)\n" \
+"steer Steering table file, lines of: slot, first symbol, and phases\n" \
+"     (degrees) of R, G and B of each adapter. Transmission n uses the\n" \
+"     lines of slot n modulo the number of slots, each from its symbol on.\n" \
+"steerdev Adapter whose columns of the steering table are used (default id)\n" \
+"synccal Measure delay and dphase from a loopback capture file of a\n" \
+"     transmission on f, with the reference adapter on the first and this\n" \
+"     one on the second channel, both with delay 0 and dphase 0.\n" \
+"     Samples are signed 16-bit, 2 channels interleaved.\n" \
+"capfs Sample rate of the capture for synccal (Hz)\n" \
+"duty Percentage of slots to transmit in, chosen randomly as in WSJT-X and\n" \
+"     avoiding consecutive transmissions. Slots then go through the bands\n" \
+"     in turn, and a duty given for each band applies to its slots;\n" \
+"     the last one given applies to the rest.\n" \
+"stop Set to 1 to stop streaming to FL2K between transmissions and\n" \
+"     start again shortly before the next slot\n" \
+"nt   Set to 1 to write the buffers with non-temporal stores, so they\n" \
+"     do not push the sine table and other data out of the caches\n" \
+"ch   Number of outputs to use (1-3), the rest stay idle\n" \
+"dither Type of dithering, by name or number:\n" \
+"     0 none\n" \
+"     1 rpdf  uniform amplitude dither of one step and phase dither (default)\n" \
+"     2 tpdf  triangular amplitude dither of two steps and phase dither\n" \
+"     3 hp    highpass shaped triangular amplitude dither, which moves\n" \
+"             its noise away from low frequencies, and phase dither\n" \
+"     4 phase phase dither only\n" \
+"     5 amp   uniform amplitude dither only\n" \
+"poly Set to 1 to compute sine by a polynomial instead of a table\n" \
+"sinebits Size of the sine table as bits of phase (8-16). By default\n" \
+"     the largest table that takes a quarter of the L1 data cache.\n" \
+"quarter Set to 1 to store only a quarter wave of the sine table,\n" \
+"     which takes a quarter of the cache at the cost of some folding\n" \
+"interp Set to 1 to interpolate linearly between the entries of a\n" \
+"     quarter wave table instead of dithering the phase. The table\n" \
+"     then has 1024 entries unless sinebits is given.\n" \
+"combine Set to 1 to use R, G and B summed through resistors as one DAC\n" \
+"     of higher resolution: each sample is quantized on R, the rest of\n" \
+"     it on G and what is still left on B. Uses the polynomial sine.\n" \
+"cwg  Weight of R relative to G in combine mode (default 64)\n" \
+"cwb  Weight of R relative to B in combine mode (default 4096)\n" \
+"cal  Calibration file for combine mode: 256 lines with the measured\n" \
+"     output of R, G and B for each code, in steps of the channel\n" \
+"share Set to 1 to compute only one output and send it to all outputs\n" \
+"     when there are no phase shifts. All outputs then get the same\n" \
+"     dither, but only a third of the samples has to be computed.\n" \
+"tune Set to 1 to transmit a continuous carrier on the first frequency\n" \
+"snap Frequency error (Hz) allowed in tune mode to make the carrier\n" \
+"     periodic, so it can be computed once and repeated.\n" \
+"     Requires dither 0.\n" \
+"ns   Number of simulated WSPR signals to transmit at once, spread\n" \
+"     randomly over 200 Hz around f, all sending the given symbols\n" \
+"sim  Set to 1 to make the ns signals simulated stations with random\n" \
+"     messages, SNR, drift and Doppler spread, in band noise\n" \
+"seed Seed for the random signals\n" \
+"noise Transmit continuous Gaussian noise of given bandwidth (Hz)\n" \
+"     centered on the first frequency, at most fs/8\n" \
+"nlevel RMS level of the noise relative to a full scale carrier (dB)\n" \
+"tones Transmit given number of continuous tones of equal level centered\n" \
+"     on the first frequency, for intermodulation measurements\n" \
+"spacing Spacing of the tones (Hz)\n" \
+"threads Number of threads to compute samples (0 for all CPUs)\n" \
+"out  Write one transmission to a file (- for stdout) as fast as\n" \
+"     possible instead of opening FL2K. Samples are unsigned 8-bit,\n" \
+"     outputs in use interleaved.\n" \
+"slots With out, write given number of whole 2-minute slots including\n" \
+"     the idle time, cycling through the bands. Continuous signals are\n" \
+"     then written for as long.\n" \
+"bench Measure speed of the inner loops over given number of buffers\n" \
+"     and exit without opening FL2K"
+
+
+/* Phases of the 3 outputs of one adapter from a symbol of a slot on */
+struct steer {
+	unsigned slot, sym;
+	uint64_t ph[3];
+};
+
+struct transmitter;
+/* Inner loop computing n samples to each output buffer */
+typedef void (*tx_kernel_t)(struct transmitter *tx, int8_t *b, unsigned long n);
+
+/* The fields are grouped by which thread writes them and how often.
+ * The state used for every span of samples is in the first three cache
+ * lines, and only the callback writes it. The callback also owns the
+ * next group, written per buffer or per transmission. Fields that one
+ * thread writes and the other reads, or both write, come after it on
+ * lines of their own, so they do not share lines with either. The rest
+ * is set up before streaming starts. The sine tables are allocated
+ * separately. */
+struct transmitter {
+	/* Hot: used and updated for every span of samples */
+	uint64_t phase, freq; // Oscillator phase and frequency
+	uint64_t lcg; // Linear congruential pseudorandom generator state
+	uint64_t phs1, phs2; // Output phase shifts
+	uint64_t dphs1, dphs2; // Their change per sample, from frequency offsets
+	double amp; // Amplitude of the sine table relative to full scale
+	tx_kernel_t kernel; // Inner loop selected for the transmission
+	int8_t *buf; // Buffer, allocated at init
+	/* Buffers sent to each output during the transmission
+	 * and the number of buffers actually computed */
+	int8_t *out[3];
+	int8_t *idle; // Buffer of idle samples
+	unsigned nout;
+	uint32_t wspr_i; // WSPR symbol index being transmitted
+	/* Sine table: full wave, and quarter wave and interpolation
+	 * tables when used, all scaled by amp, and the number of phase
+	 * bits used for the lookup */
+	const int16_t *sine, *qsine;
+	const int32_t *isine;
+	unsigned sine_bits;
+	char dither, poly, nt;
+	const struct combine *comb; // Combined DAC, if used
+	/* Per symbol state */
+	uint64_t wspr_symphase;
+	uint64_t wspr_freq;
+	const char *wspr_data;
+
+	/* Written by the callback per buffer or per transmission.
+	 * Phase of red and the shifts of green and blue for each symbol,
+	 * planned at the start of each transmission from the configured
+	 * shifts, their steps per symbol, the program read from a file,
+	 * and the steering table */
+	uint64_t phs_plan[WSPR_LEN][3] __attribute__((aligned(64)));
+	unsigned slot; // Transmissions started, for the steering table
+	unsigned swapped; // Green and blue swapped by ps
+	unsigned long lead; // Idle samples in the buffer before a synchronized start
+	unsigned long cache_pos; // Position in the cached carrier
+	unsigned msg_i[MAX_FREQS]; // Next message to send, per band with rotate
+	uint64_t tone_phase[MAX_TONES]; // Phase of each tone
+
+	/* Shared between the callback and the main thread */
+	volatile char initialized __attribute__((aligned(64)));
+	volatile char wspr_on; // Transmission in progress
+	char streaming; // FL2K is streaming
+	volatile unsigned long callbacks; // Number of callbacks from FL2K
+	struct timespec first_callback; // Time of the first one since streaming started
+	volatile char armed; // Scheduler chose to transmit in the next slot
+	volatile char stopping; // Send only idle samples until streaming stops
+	volatile unsigned long sent[MAX_FREQS]; // Transmissions started on each band
+	/* Band of the next transmission, set by the scheduler and
+	 * advanced by each transmission */
+	uint32_t wspr_freq_i;
+	/* Timeline of the samples for sync: callbacks when streaming
+	 * started, and time of the first sample from the second sync_epoch,
+	 * tracked as the earliest callback since the latency only adds */
+	volatile unsigned long sync_base;
+	volatile char sync_valid;
+	time_t sync_epoch;
+	double sync_t0;
+	/* Sample rate and the tuning words depending on it, which the
+	 * main thread changes between transmissions with bandfs */
+	double fs; // Exact sample rate
+	double fs_nominal;
+	uint64_t wspr_step;
+	uint64_t wspr_freqs[MAX_FREQS];
+
+	/* Cold: configuration and setup */
+	uint64_t phs_base[2] __attribute__((aligned(64)));
+	uint64_t phs_step[2];
+	uint64_t *phs_prog; // Shifts read from a file, 2 per line
+	unsigned phs_nprog;
+	char phs_vary; // Shifts change during the transmission
+	struct steer *steer; // Steering table, sorted by slot and symbol
+	unsigned nsteer, steer_slots;
+	double df[2]; // Frequency offsets (Hz)
+	char sync; // Start on the exact sample of the slot
+	char sched; // Transmit only when armed by the scheduler
+	double delay, dphase; // Start delay (samples) and phase shift (degrees)
+	char ps, share, tune, quarter, interp; // Flags
+	char sine_full; // The full wave table is used
+	/* Tables, allocated at init: nsine sets of each one scaled for
+	 * a band, and the entries from one set to the next */
+	int16_t *sine_buf, *qsine_buf;
+	int32_t *isine_buf;
+	unsigned nsine;
+	unsigned long sine_len, qsine_len, isine_len;
+	unsigned nch; // Number of outputs used
+	/* Periodic carrier computed at init, when possible in tune mode */
+	int8_t *cache;
+	unsigned long cache_len, cache_period;
+	struct synth *synth; // Synthesizer for many signals, if used
+	struct noise *noise; // Noise generator, if used
+	/* Multi-tone test signal: frequencies and the gain of each tone */
+	unsigned ntones;
+	uint64_t tone_freq[MAX_TONES];
+	float tone_gain;
+	struct workers *workers; // Threads to compute buffers
+	int8_t **scratch; // With non-temporal stores, scratch areas for each thread
+
+	/* Symbols of the messages, encoded at start */
+	char (*msgs)[WSPR_LEN + 1];
+	unsigned nmsgs;
+	char rotate;
+
+	uint32_t wspr_nfreqs;
+	// Per band amplitude relative to full scale
+	double wspr_amps[MAX_FREQS];
+	double wspr_hz[MAX_FREQS]; // Band frequencies in Hz
+	double wspr_fs[MAX_FREQS]; // Nominal sample rates
+};
+
+/* Frequencies above the sample rate are reduced modulo fs,
+ * so the phase accumulator then generates the corresponding alias
+ * and the wanted frequency appears as one of its images. */
+uint64_t tx_hz_to_freq(struct transmitter *tx, double hz)
+{
+	double r = hz / (double)tx->fs;
+	return (r - floor(r)) * ((double)(1ULL<<63) * 2.0);
+}
+
+/* Phase shift in degrees, which may be negative or over 360 */
+uint64_t tx_deg_to_phase(double deg)
+{
+	double r = deg / 360.0;
+	return (r - floor(r)) * ((double)(1ULL<<63) * 2.0);
+}
+
+/* Read a phase program: a line of green and blue phase shifts
+ * (degrees) for each symbol. Returns the number of lines read,
+ * 0 if the file cannot be read or has no valid lines. */
+unsigned tx_load_phases(struct transmitter *tx, const char *path)
+{
+	double p[2];
+	unsigned n = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	tx->phs_prog = calloc(2 * WSPR_LEN, sizeof(*tx->phs_prog));
+	while (n < WSPR_LEN && fscanf(f, "%lf %lf", &p[0], &p[1]) == 2) {
+		tx->phs_prog[2*n] = tx_deg_to_phase(p[0]);
+		tx->phs_prog[2*n + 1] = tx_deg_to_phase(p[1]);
+		n++;
+	}
+	fclose(f);
+	tx->phs_nprog = n;
+	return n;
+}
+
+static int steer_cmp(const void *a, const void *b)
+{
+	const struct steer *x = a, *y = b;
+	if (x->slot != y->slot)
+		return x->slot < y->slot ? -1 : 1;
+	return x->sym < y->sym ? -1 : x->sym > y->sym;
+}
+
+/* Read a steering table: lines of slot, first symbol and the phases
+ * (degrees) of R, G and B of each adapter, of which the columns of
+ * adapter dev are kept. Returns the number of lines read, 0 if the
+ * file cannot be read or has no line with the columns of dev. */
+unsigned tx_load_steer(struct transmitter *tx, const char *path, unsigned dev)
+{
+	char line[4096];
+	unsigned n = 0, size = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double v[2 + 3 * 64];
+		char *p = line, *e;
+		unsigned k, nv = 0;
+		while (nv < 2 + 3 * 64 && (v[nv] = strtod(p, &e), e != p)) {
+			p = e;
+			nv++;
+		}
+		if (nv < 2 + 3 * (dev + 1) || v[0] < 0 || v[1] < 0 || v[1] >= WSPR_LEN)
+			continue;
+		if (n == size) {
+			size = size ? 2 * size : 64;
+			tx->steer = realloc(tx->steer, size * sizeof(*tx->steer));
+		}
+		tx->steer[n].slot = v[0];
+		tx->steer[n].sym = v[1];
+		for (k = 0; k < 3; k++)
+			tx->steer[n].ph[k] = tx_deg_to_phase(v[2 + 3 * dev + k]);
+		if (tx->steer[n].slot >= tx->steer_slots)
+			tx->steer_slots = tx->steer[n].slot + 1;
+		n++;
+	}
+	fclose(f);
+	qsort(tx->steer, n, sizeof(*tx->steer), steer_cmp);
+	tx->nsteer = n;
+	return n;
+}
+
+/* Plan the phase of red and the shifts of green and blue for each
+ * symbol of the next transmission, and set their frequency offsets,
+ * so that the sample loop only sees constants for each span. With ps,
+ * green and blue swap everything on every transmission. The steering
+ * table gives absolute phases, so red moves the oscillator phase and
+ * the others are relative to it. */
+void tx_plan_phases(struct transmitter *tx)
+{
+	unsigned s, c, i = 0;
+	const struct steer *st = NULL;
+	const unsigned slot = tx->steer_slots ? tx->slot % tx->steer_slots : 0;
+	while (i < tx->nsteer && tx->steer[i].slot < slot)
+		i++;
+	tx->phs_vary = 0;
+	for (s = 0; s < WSPR_LEN; s++) {
+		for (; i < tx->nsteer && tx->steer[i].slot == slot && tx->steer[i].sym <= s; i++)
+			st = &tx->steer[i];
+		tx->phs_plan[s][0] = st ? st->ph[0] : 0;
+		for (c = 0; c < 2; c++) {
+			const unsigned k = c ^ tx->swapped;
+			uint64_t p = tx->phs_base[k] + s * tx->phs_step[k];
+			if (tx->phs_nprog)
+				p += tx->phs_prog[(s % tx->phs_nprog) * 2 + k];
+			if (st)
+				p += st->ph[1 + k] - st->ph[0];
+			tx->phs_plan[s][1 + c] = p;
+			if (p != tx->phs_plan[0][1 + c])
+				tx->phs_vary = 1;
+		}
+	}
+	tx->phs1 = tx->phs_plan[0][1];
+	tx->phs2 = tx->phs_plan[0][2];
+	tx->dphs1 = tx_hz_to_freq(tx, tx->df[tx->swapped]);
+	tx->dphs2 = tx_hz_to_freq(tx, tx->df[!tx->swapped]);
+	tx->phs_vary |= tx->dphs1 != 0 || tx->dphs2 != 0;
+}
+
+/* Relative amplitude response of the zero-order hold DAC */
+double tx_sinc(double x)
+{
+	if (x == 0)
+		return 1;
+	return fabs(sin(3.141592653589793 * x) / (3.141592653589793 * x));
+}
+
+/* Default sine table size: the largest table taking at most a quarter
+ * of the L1 data cache, leaving the rest for the buffers being
+ * written. Each bit halves the phase truncation error, so spurs drop
+ * by 6 dB per bit, and with dithering they are spread into noise. */
+unsigned tx_default_sine_bits(char quarter)
+{
+	long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+	unsigned bits;
+	if (l1 <= 0)
+		return SINE_BITS_DEFAULT;
+	/* Entries of 2 bytes, a quarter wave holds a quarter of them */
+	for (bits = SINE_BITS_MIN; bits < SINE_BITS_MAX; bits++)
+		if ((2L << (bits + 1)) >> (quarter ? 2 : 0) > l1 / 4)
+			break;
+	return bits;
+}
+
+/* Fill the tables of each band amplitude. Without eq, all bands share
+ * the first set. */
+void tx_make_sine(struct transmitter *tx)
+{
+	unsigned i, k, n = 1U << tx->sine_bits;
+	for (k = 0; k < tx->nsine; k++) {
+		const double amp = tx->wspr_amps[k];
+		if (tx->sine_full) {
+			int16_t *sine = tx->sine_buf + k * tx->sine_len;
+			for (i = 0; i < n; i++)
+				sine[i] = sin(6.283185307179586 * i / n) * 0x7EFF * amp;
+		}
+		/* Quarter wave including the peak */
+		if (tx->quarter) {
+			int16_t *qsine = tx->qsine_buf + k * tx->qsine_len;
+			for (i = 0; i <= n / 4; i++)
+				qsine[i] = sin(6.283185307179586 * i / n) * 0x7EFF * amp;
+		}
+		/* Rounded values in the low and differences to the next entry
+		 * in the high halves, so one load gives both */
+		if (tx->interp) {
+			int32_t *isine = tx->isine_buf + k * tx->isine_len, v = 0, next;
+			for (i = 0; i <= n / 4; i++, v = next) {
+				next = i < n / 4 ? lrint(sin(6.283185307179586 * (i + 1) / n) * 0x7EFF * amp) : v;
+				isine[i] = (uint32_t)(next - v) << 16 | (uint16_t)v;
+			}
+		}
+	}
+}
+
+/* Point the loops at the tables of a band, which is cheap enough for
+ * the callback */
+void tx_use_sine(struct transmitter *tx, unsigned band)
+{
+	const unsigned k = band % tx->nsine;
+	tx->sine = tx->sine_buf ? tx->sine_buf + k * tx->sine_len : NULL;
+	tx->qsine = tx->qsine_buf ? tx->qsine_buf + k * tx->qsine_len : NULL;
+	tx->isine = tx->isine_buf ? tx->isine_buf + k * tx->isine_len : NULL;
+	tx->amp = tx->wspr_amps[k];
+}
+
+/* Set the sine table size and allocate the tables, one set for each
+ * band amplitude. They are filled here once the bands are planned,
+ * otherwise by tx_init. */
+void tx_alloc_sine(struct transmitter *tx, unsigned bits, char quarter, char interp)
+{
+	free(tx->sine_buf);
+	free(tx->qsine_buf);
+	free(tx->isine_buf);
+	tx->sine_bits = bits;
+	tx->quarter = quarter;
+	tx->interp = interp;
+	/* Sets rounded up to cache lines, which aligned_alloc requires
+	 * and which keeps each of them aligned */
+	tx->sine_len = ((2UL << bits) + 63) / 64 * 32;
+	tx->qsine_len = ((2UL << (bits - 2)) + 2 + 63) / 64 * 32;
+	tx->isine_len = ((4UL << (bits - 2)) + 4 + 63) / 64 * 16;
+	tx->sine_buf = tx->sine_full ?
+		aligned_alloc(64, tx->nsine * tx->sine_len * sizeof(*tx->sine_buf)) : NULL;
+	tx->qsine_buf = quarter ?
+		aligned_alloc(64, tx->nsine * tx->qsine_len * sizeof(*tx->qsine_buf)) : NULL;
+	tx->isine_buf = interp ?
+		aligned_alloc(64, tx->nsine * tx->isine_len * sizeof(*tx->isine_buf)) : NULL;
+	if (interp) {
+		/* Mean square error of linear interpolation relative to the
+		 * carrier is h^4/120 for a step of h radians, plus rounding
+		 * of the entries and of the result */
+		const double h = 6.283185307179586 / (1U << bits);
+		INFO("Sine interpolated from a quarter wave table of %u entries (%lu bytes), "
+			"error about %.0f dBc\n", (1U << bits) / 4 + 1,
+			((1UL << bits) / 4 + 1) * sizeof(*tx->isine_buf),
+			10.0 * log10(h * h * h * h / 120 + 1.0 / (3.0 * 0x7EFF * 0x7EFF)));
+	} else
+		INFO("Sine table of %u entries%s, phase truncation spurs about %.0f dBc\n",
+			1U << bits, quarter ? " stored as a quarter wave" : "", -6.02 * bits);
+	if (tx->wspr_nfreqs) {
+		tx_make_sine(tx);
+		tx_use_sine(tx, 0);
+	}
+}
+
+/* Work out where each band is transmitted: as the fundamental below
+ * fs/2, or as image number n of it in Nyquist zone n*fs +- fb.
+ * tx_hz_to_freq wraps the tuning word around to fb, and every image
+ * of it keeps the phase of the samples, also on the mirrored side
+ * (n*fs - fb), so nothing else depends on the image.
+ * The levels are worked out here once, so the sample loop only sees
+ * a tuning word and a sine table scaled for the band. */
+void tx_plan_bands(struct transmitter *tx, struct configuration *conf)
+{
+	unsigned i;
+	double minlevel = 1;
+	double level[MAX_FREQS];
+	for (i = 0; i < conf->nf; i++) {
+		double f = conf->f[i];
+		/* Corrected sample rate of the band */
+		double fs = conf->bfs[i] * (tx->fs / tx->fs_nominal);
+		double n = floor(f / fs + 0.5);
+		double fb = f - n * fs;
+		level[i] = tx_sinc(f / fs);
+		if (level[i] < minlevel)
+			minlevel = level[i];
+		tx->wspr_freqs[i] = tx_hz_to_freq(tx, f);
+		tx->wspr_hz[i] = f;
+		tx->wspr_fs[i] = conf->bfs[i];
+		if (conf->bandfs)
+			INFO("Band %u: sample rate %.0f Hz\n", i, conf->bfs[i]);
+		if (n == 0) {
+			INFO("Band %u: %.1f Hz, fundamental, level %.1f dB\n",
+				i, f, 20.0 * log10(level[i]));
+		} else {
+			/* The strongest alias is the fundamental at |fb| */
+			double alias = fabs(fb);
+			/* Nearest other image of the same baseband tone */
+			double sep = fmin(2.0 * alias, fs - 2.0 * alias);
+			INFO("Band %u: %.1f Hz, image %.0f*fs %c %.1f Hz, "
+				"level %.1f dB (%.1f dB relative to %.1f Hz)\n",
+				i, f, n, fb < 0 ? '-' : '+', alias,
+				20.0 * log10(level[i]),
+				20.0 * log10(level[i] / tx_sinc(alias / fs)),
+				alias);
+			if (sep < 0.1 * fs)
+				INFO("Warning: another image is only %.1f Hz away\n", sep);
+		}
+	}
+	for (i = 0; i < conf->nf; i++) {
+		tx->wspr_amps[i] = conf->eq ? minlevel / level[i] : 1.0;
+		if (tx->wspr_amps[i] != 1.0)
+			INFO("Band %u: attenuated by %.1f dB for equalization\n",
+				i, -20.0 * log10(tx->wspr_amps[i]));
+	}
+	tx->wspr_nfreqs = conf->nf;
+}
+
+/* Lowest sample rate for a band up to fsmax, such that the first image
+ * is far enough to filter out easily and the aliases of the 2nd to 5th
+ * harmonics of the DAC output do not fall near the band. Bands above
+ * fsmax / BANDFS_OS keep fsmax. */
+double band_fs(double f, double fsmax)
+{
+	double fs = ceil(BANDFS_OS * f / BANDFS_STEP) * BANDFS_STEP;
+	unsigned k;
+	if (fs < BANDFS_MIN)
+		fs = BANDFS_MIN;
+	for (; fs < fsmax; fs += BANDFS_STEP) {
+		for (k = 2; k <= 5; k++) {
+			double a = fmod(k * f, fs);
+			if (a > 0.5 * fs)
+				a = fs - a;
+			if (fabs(a - f) < BANDFS_SPUR * f)
+				break;
+		}
+		if (k > 5)
+			return fs;
+	}
+	return fsmax;
+}
+
+/* Change to another sample rate between transmissions: the tuning
+ * words of all bands are computed again for the corrected rate. */
+void tx_set_fs(struct transmitter *tx, double nominal, double exact)
+{
+	unsigned i;
+	tx->fs = exact;
+	tx->fs_nominal = nominal;
+	tx->wspr_step = tx_hz_to_freq(tx, 12000.0 / 8192);
+	for (i = 0; i < tx->wspr_nfreqs; i++)
+		tx->wspr_freqs[i] = tx_hz_to_freq(tx, tx->wspr_hz[i]);
+}
+
+/* Pool of threads to compute parts of a buffer in parallel.
+ * The calling thread does one part itself. */
+struct worker {
+	struct workers *w;
+	unsigned i;
+	pthread_t thread;
+};
+
+struct workers {
+	unsigned n; // Number of parts, including the calling thread
+	struct worker *worker;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned gen, busy;
+	void (*fn)(void *arg, unsigned i, unsigned n);
+	void *arg;
+};
+
+static void *workers_thread(void *p)
+{
+	struct worker *wk = p;
+	struct workers *w = wk->w;
+	unsigned gen = 0;
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->gen == gen)
+			pthread_cond_wait(&w->start, &w->lock);
+		gen = w->gen;
+		pthread_mutex_unlock(&w->lock);
+
+		w->fn(w->arg, wk->i, w->n);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->busy == 0)
+			pthread_cond_signal(&w->done);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+struct workers *workers_init(unsigned n)
+{
+	unsigned i;
+	struct workers *w = calloc(1, sizeof(*w));
+	if (n == 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	w->n = n;
+	w->worker = calloc(n, sizeof(*w->worker));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->start, NULL);
+	pthread_cond_init(&w->done, NULL);
+	for (i = 1; i < n; i++) {
+		w->worker[i].w = w;
+		w->worker[i].i = i;
+		pthread_create(&w->worker[i].thread, NULL, workers_thread, &w->worker[i]);
+	}
+	return w;
+}
+
+/* Call fn(arg, i, n) for i = 0...n-1 in parallel and wait for them */
+void workers_run(struct workers *w, void (*fn)(void *arg, unsigned i, unsigned n), void *arg)
+{
+	if (w == NULL || w->n <= 1) {
+		fn(arg, 0, 1);
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	w->fn = fn;
+	w->arg = arg;
+	w->busy = w->n - 1;
+	w->gen++;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+
+	fn(arg, 0, w->n);
+
+	pthread_mutex_lock(&w->lock);
+	while (w->busy)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* State of the dithering LCG n steps ahead, so that parts of a buffer
+ * can be computed independently. Combines the steps by squaring. */
+uint64_t lcg_skip(uint64_t lcg, uint64_t n)
+{
+	uint64_t a = 6364136223846793005ULL, c = 1;
+	uint64_t an = 1, cn = 0;
+	for (; n; n >>= 1) {
+		if (n & 1) {
+			an *= a;
+			cn = cn * a + c;
+		}
+		c *= a + 1;
+		a *= a;
+	}
+	return an * lcg + cn;
+}
+
+/* Types of dithering */
+#define DITHER_NONE 0
+#define DITHER_RPDF 1
+#define DITHER_TPDF 2
+#define DITHER_HP 3
+#define DITHER_PHASE 4
+#define DITHER_AMP 5
+#define DITHER_TYPES 6
+static const char *const dither_names[DITHER_TYPES] = {
+	"none", "rpdf", "tpdf", "hp", "phase", "amp" };
+
+static inline int tx_dither_phase(const int dither)
+{
+	return dither != DITHER_NONE && dither != DITHER_AMP;
+}
+
+static inline int tx_dither_amp(const int dither)
+{
+	return dither != DITHER_NONE && dither != DITHER_PHASE;
+}
+
+/* LCG steps per sample, TPDF takes two numbers */
+static inline unsigned tx_dither_steps(const int dither)
+{
+	return dither == DITHER_TPDF ? 2 : dither != DITHER_NONE;
+}
+
+/* State of the LCG n samples ahead */
+static inline uint64_t tx_dither_skip(const int dither, uint64_t lcg, uint64_t n)
+{
+	return lcg_skip(lcg, n * tx_dither_steps(dither));
+}
+
+/* Pseudorandom numbers for dithering one sample: r[0] for this sample,
+ * r[1] the one of the previous sample for highpass shaping and r[2] a
+ * second one for TPDF. Generator parameters from
+ * https://en.wikipedia.org/wiki/Linear_congruential_generator#Parameters_in_common_use */
+static inline void tx_dither_rand(const int dither, uint64_t *lcg, uint32_t r[3])
+{
+	r[1] = *lcg >> 32;
+	*lcg = *lcg * 6364136223846793005ULL + 1;
+	r[0] = *lcg >> 32;
+	r[2] = 0;
+	if (dither == DITHER_TPDF) {
+		*lcg = *lcg * 6364136223846793005ULL + 1;
+		r[2] = *lcg >> 32;
+	}
+}
+
+/* Amplitude dither of output c in 1/256 of an output step, using
+ * different bits of the numbers for each output. Uniform dither is
+ * 0...255, so the truncation that follows rounds on average, and the
+ * triangular ones have the same mean. Highpass shaping takes the
+ * difference of consecutive numbers instead of the sum of two. */
+static inline int32_t tx_dither_value(const int dither, const uint32_t r[3], unsigned c)
+{
+	const unsigned sh = 8 * c;
+	if (dither == DITHER_TPDF)
+		return (int32_t)(0xFF & r[0] >> sh) + (0xFF & r[2] >> sh) - 0x7F;
+	if (dither == DITHER_HP)
+		return (int32_t)(0xFF & r[0] >> sh) - (0xFF & r[1] >> sh) + 0x80;
+	return 0xFF & r[0] >> sh;
+}
+
+/* Triangular dither exceeds the headroom left by the sine table, so
+ * limit to what quantizes to 0...255. Done without comparisons, like
+ * the vector version. */
+static inline int32_t tx_dither_clamp(int32_t v)
+{
+	v += 0x7F00;
+	v &= ~(v >> 31);
+	v = 0xFFFF - v;
+	v &= ~(v >> 31);
+	return 0x80FF - v;
+}
+
+/* Synthesizer for many simultaneous WSPR signals.
+ * Summing one oscillator per signal at the full sample rate would cost
+ * O(samples * signals), so instead the composite is built at a low
+ * baseband rate by inverse FFT overlap-add, and only the composite is
+ * interpolated and mixed up to the band by the transmitter oscillator.
+ *
+ * Each frame of SYNTH_N baseband samples is a Hann-windowed piece of
+ * the composite, and frames overlap by half, so the windows sum to one.
+ * Within a frame, each signal is a tone at its frequency at the frame
+ * center, with its phase at the frame center. The spectrum of a
+ * windowed tone is the Hann kernel shifted to the tone frequency, which
+ * falls off fast enough to compute only SYNTH_L bins on each side of it,
+ * leaving the rest of the kernel about 60 dB below the tone.
+ * The cost per frame is then O(signals * SYNTH_L + SYNTH_N log SYNTH_N).
+ *
+ * Symbol changes between frame centers become short crossfades over
+ * half a frame, about 40 ms, with a phase error below 0.3 radians.
+ *
+ * In simulation mode, the signals are random stations with their own
+ * messages, SNR, drift and Doppler spread, and complex Gaussian noise is
+ * added to the baseband, so that the SNR is defined like in WSPR, in
+ * 2500 Hz bandwidth, and the noise fills the 3 kHz around the band. */
+#define SYNTH_FB 3000.0 // Nominal baseband sample rate (Hz)
+#define SYNTH_N 256 // FFT size and frame length
+#define SYNTH_H (SYNTH_N/2) // Frame hop
+#define SYNTH_L 8 // Bins computed on each side of a tone
+#define SYNTH_BW 200.0 // Width of the band filled with signals (Hz)
+#define SYNTH_DT 2.0 // Maximum start time of a signal (s)
+#define SIM_SNR_MIN -28.0 // Range of SNR of simulated stations (dB)
+#define SIM_SNR_MAX 10.0
+#define SIM_DRIFT 1.0 // Maximum drift (Hz per minute)
+#define SIM_SPREAD 0.5 // Maximum RMS frequency deviation of Doppler spread (Hz)
+
+#define WSPR_SYMLEN (8192.0 / 12000.0) // Symbol length (s)
+#define WSPR_SPACING (12000.0 / 8192.0) // Tone spacing (Hz)
+
+struct synth_signal {
+	const char *data; // Symbols
+	double df; // Frequency of symbol 0 from the band frequency (Hz)
+	double t0; // Start time from the start of transmission (s)
+	float amp;
+	double phase; // Phase at time t (cycles)
+	double t;
+	/* Simulated station */
+	char msg[WSPR_LEN + 1]; // Symbols of its own message
+	double drift; // Hz per second
+	double spread; // RMS frequency deviation (Hz)
+	double fj; // Current frequency deviation (Hz)
+};
+
+/* Part of a buffer between two baseband samples */
+struct synth_seg {
+	unsigned long start, len;
+	complex float v, dv;
+};
+
+struct synth {
+	unsigned nsig;
+	struct synth_signal *sig;
+	double fb; // Exact baseband sample rate
+	unsigned long d; // Output samples per baseband sample
+	unsigned long frame; // Frames computed in this transmission
+	unsigned long nframes; // Frames in the transmission
+	uint64_t seed;
+	char sim;
+	float noise; // Standard deviation of baseband noise, per component
+	/* Parts of the buffer being computed */
+	struct synth_seg *seg;
+	unsigned nseg;
+	complex float spec[SYNTH_N], ola[SYNTH_N], tw[SYNTH_N];
+	/* Baseband samples of the last frame and position in them */
+	unsigned bb_i;
+	/* Interpolator state: value, increment per sample,
+	 * next baseband sample and output samples left until it */
+	complex float v, dv, next;
+	unsigned long k;
+};
+
+/* Uniform random number in [0, 1) */
+double synth_random(uint64_t *state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (*state >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Normally distributed random number */
+double synth_gauss(uint64_t *state)
+{
+	double u = 1.0 - synth_random(state);
+	return sqrt(-2.0 * log(u)) * cos(6.283185307179586 * synth_random(state));
+}
+
+static unsigned synth_randint(uint64_t *state, unsigned n)
+{
+	return synth_random(state) * n;
+}
+
+struct synth *synth_init(unsigned nsig, double fs, char sim, uint64_t seed)
+{
+	unsigned i;
+	struct synth *sy = calloc(1, sizeof(*sy));
+	sy->nsig = nsig;
+	sy->sig = calloc(nsig, sizeof(*sy->sig));
+	sy->d = lrint(fs / SYNTH_FB);
+	sy->fb = fs / sy->d;
+	for (i = 0; i < SYNTH_N; i++)
+		sy->tw[i] = cexp(6.283185307179586 * I * i / SYNTH_N);
+	sy->sim = sim;
+	sy->seed = seed;
+	sy->seg = malloc((FL2K_BUF_LEN / sy->d + 2) * sizeof(*sy->seg));
+	return sy;
+}
+
+/* Random station with a valid message.
+ * Returns its SNR in dB. */
+static double synth_station(struct synth *sy, struct synth_signal *s, double hz)
+{
+	static const int powers[] = { 0, 3, 7, 10, 13, 17, 20, 23, 27, 30,
+		33, 37, 40, 43, 47, 50, 53, 57, 60 };
+	uint64_t *r = &sy->seed;
+	char call[7], loc[5];
+	int len = 0, i, dbm;
+	call[len++] = 'A' + synth_randint(r, 26);
+	if (synth_randint(r, 2))
+		call[len++] = 'A' + synth_randint(r, 26);
+	call[len++] = '0' + synth_randint(r, 10);
+	for (i = 1 + synth_randint(r, 3); i > 0; i--)
+		call[len++] = 'A' + synth_randint(r, 26);
+	call[len] = '\0';
+	loc[0] = 'A' + synth_randint(r, 18);
+	loc[1] = 'A' + synth_randint(r, 18);
+	loc[2] = '0' + synth_randint(r, 10);
+	loc[3] = '0' + synth_randint(r, 10);
+	loc[4] = '\0';
+	dbm = powers[synth_randint(r, sizeof(powers) / sizeof(*powers))];
+	wspr_encode(call, loc, dbm, s->msg);
+	s->data = s->msg;
+
+	double snr = SIM_SNR_MIN + (SIM_SNR_MAX - SIM_SNR_MIN) * synth_random(r);
+	s->drift = (2.0 * synth_random(r) - 1.0) * SIM_DRIFT / 60.0;
+	s->spread = SIM_SPREAD * synth_random(r);
+	s->fj = 0;
+	/* Frequency given like WSPR does, at the middle of the 4 tones */
+	INFO("Station %-6s %s %2d dBm, SNR %5.1f dB, %.1f Hz, DT %.2f s, "
+		"drift %+.2f Hz/min, spread %.2f Hz\n",
+		call, loc, dbm, snr, hz + s->df + 1.5 * WSPR_SPACING, s->t0,
+		s->drift * 60.0, s->spread);
+	return snr;
+}
+
+/* Randomize the signals for a new transmission on band frequency hz */
+void synth_start(struct synth *sy, const char *data, double hz)
+{
+	unsigned i;
+	/* Keep the peak of the sum of random phase tones within full scale
+	 * most of the time, output is clipped if it does not fit */
+	float amp = fmax(1.0 / sy->nsig, 0.25 / sqrt(sy->nsig));
+	double length = 0, power = 1;
+	for (i = 0; i < sy->nsig; i++) {
+		struct synth_signal *s = &sy->sig[i];
+		s->data = data;
+		s->df = (synth_random(&sy->seed) - 0.5) * (SYNTH_BW - 4 * WSPR_SPACING);
+		s->t0 = synth_random(&sy->seed) * SYNTH_DT;
+		s->amp = amp;
+		s->phase = synth_random(&sy->seed);
+		s->t = s->t0;
+		s->drift = s->spread = s->fj = 0;
+		if (sy->sim) {
+			/* Amplitude relative to noise of unit power */
+			double snr = synth_station(sy, s, hz);
+			s->amp = sqrt(pow(10.0, 0.1 * snr) * 2500.0 / sy->fb);
+			power += s->amp * s->amp;
+		}
+		if (s->t0 + WSPR_LEN * WSPR_SYMLEN > length)
+			length = s->t0 + WSPR_LEN * WSPR_SYMLEN;
+	}
+	sy->noise = 0;
+	if (sy->sim) {
+		/* Scale the total to an RMS level of 1/4 of full scale */
+		float scale = 0.25 / sqrt(power);
+		for (i = 0; i < sy->nsig; i++)
+			sy->sig[i].amp *= scale;
+		sy->noise = scale * sqrt(0.5);
+	}
+	sy->nframes = ceil(length * sy->fb / SYNTH_H) + 2;
+	sy->frame = 0;
+	sy->bb_i = SYNTH_H;
+	sy->k = 0;
+	sy->v = sy->dv = sy->next = 0;
+	memset(sy->ola, 0, sizeof(sy->ola));
+}
+
+/* Symbol of signal at time t, clamped to the transmission */
+static int synth_symbol(struct synth_signal *s, double t)
+{
+	int i = floor((t - s->t0) / WSPR_SYMLEN);
+	if (i < 0)
+		i = 0;
+	if (i >= WSPR_LEN)
+		i = WSPR_LEN - 1;
+	return i;
+}
+
+/* Advance the phase of a signal to time t */
+static void synth_advance(struct synth_signal *s, double t)
+{
+	int i, i1 = synth_symbol(s, s->t), i2 = synth_symbol(s, t);
+	double t1 = s->t, c = 0;
+	for (i = i1; i <= i2; i++) {
+		double tb = i < i2 ? s->t0 + (i + 1) * WSPR_SYMLEN : t;
+		c += WSPR_SPACING * (s->data[i] - '0') * (tb - t1);
+		t1 = tb;
+	}
+	/* Offset, Doppler deviation and drift */
+	c += (s->df + s->fj) * (t - s->t);
+	c += 0.5 * s->drift * ((t - s->t0) * (t - s->t0) - (s->t - s->t0) * (s->t - s->t0));
+	s->phase = fmod(s->phase + c, 1.0);
+	s->t = t;
+}
+
+/* Dirichlet kernel sin(pi x) / sin(pi x / N) */
+static double synth_dirichlet(double x)
+{
+	double d = sin(3.141592653589793 * x / SYNTH_N);
+	if (fabs(d) < 1e-12)
+		return SYNTH_N;
+	return sin(3.141592653589793 * x) / d;
+}
+
+/* Spectrum of a Hann window shifted by x bins, with the phase
+ * referenced to the center of the frame */
+static complex double synth_hann(double x)
+{
+	const double p = 3.141592653589793 / SYNTH_N;
+	return cexp(-I * p * x) * (0.5 * synth_dirichlet(x)
+		+ 0.25 * cexp(-I * p) * synth_dirichlet(x + 1)
+		+ 0.25 * cexp(I * p) * synth_dirichlet(x - 1));
+}
+
+/* In-place inverse FFT, not normalized */
+static void synth_ifft(struct synth *sy, complex float *x)
+{
+	unsigned i, j, len;
+	for (i = 1, j = 0; i < SYNTH_N; i++) {
+		unsigned bit = SYNTH_N >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			complex float t = x[i];
+			x[i] = x[j];
+			x[j] = t;
+		}
+	}
+	for (len = 2; len <= SYNTH_N; len <<= 1) {
+		unsigned step = SYNTH_N / len;
+		for (i = 0; i < SYNTH_N; i += len) {
+			for (j = 0; j < len / 2; j++) {
+				complex float a = x[i + j];
+				complex float b = x[i + j + len / 2] * sy->tw[j * step];
+				x[i + j] = a + b;
+				x[i + j + len / 2] = a - b;
+			}
+		}
+	}
+}
+
+/* Compute the next frame and add it to the overlap-add buffer.
+ * The first half of the buffer is then complete. */
+void synth_frame(struct synth *sy)
+{
+	unsigned i;
+	int j;
+	/* Time at the center of the frame */
+	double tc = (sy->frame + 1) * SYNTH_H / sy->fb;
+
+	memset(sy->spec, 0, sizeof(sy->spec));
+	for (i = 0; i < sy->nsig; i++) {
+		struct synth_signal *s = &sy->sig[i];
+		if (tc < s->t0 || tc >= s->t0 + WSPR_LEN * WSPR_SYMLEN)
+			continue;
+		synth_advance(s, tc);
+		if (s->spread != 0) {
+			/* Doppler spread as a random walk of the frequency
+			 * with a correlation time of some frames */
+			s->fj = 0.9 * s->fj + 0.436 * s->spread * synth_gauss(&sy->seed);
+		}
+		double f = s->df + s->fj + s->drift * (tc - s->t0)
+			+ WSPR_SPACING * (s->data[synth_symbol(s, tc)] - '0');
+		double x = f * SYNTH_N / sy->fb;
+		int j0 = lrint(x);
+		complex double a = s->amp * cexp(6.283185307179586 * I * s->phase) / SYNTH_N;
+		for (j = j0 - SYNTH_L; j <= j0 + SYNTH_L; j++)
+			sy->spec[j & (SYNTH_N-1)] += (j & 1 ? -a : a) * synth_hann(x - j);
+	}
+	synth_ifft(sy, sy->spec);
+
+	memmove(sy->ola, sy->ola + SYNTH_H, sizeof(*sy->ola) * SYNTH_H);
+	memset(sy->ola + SYNTH_H, 0, sizeof(*sy->ola) * SYNTH_H);
+	for (i = 0; i < SYNTH_N; i++)
+		sy->ola[i] += sy->spec[i];
+	sy->frame++;
+	sy->bb_i = 0;
+}
+
+/* Set up interpolation towards the next baseband sample.
+ * Returns 0 at the end of the transmission. */
+int synth_next(struct synth *sy)
+{
+	if (sy->bb_i >= SYNTH_H) {
+		if (sy->frame >= sy->nframes)
+			return 0;
+		synth_frame(sy);
+	}
+	sy->v = sy->next;
+	sy->next = sy->ola[sy->bb_i++];
+	if (sy->noise != 0)
+		sy->next += sy->noise * (synth_gauss(&sy->seed) + I * synth_gauss(&sy->seed));
+	sy->dv = (sy->next - sy->v) / sy->d;
+	sy->k = sy->d;
+	return 1;
+}
+
+/* Sine of a 64-bit phase by an odd polynomial. The error is below
+ * -75 dB, well under the 8-bit quantization floor, and since there is
+ * no phase truncation, phase dithering is not needed. */
+static inline float tx_poly_sine(uint64_t ph)
+{
+	/* Phase as a signed number, full scale corresponding to +-pi */
+	int64_t x = (int32_t)(ph >> 32);
+	/* Fold to -pi/2...pi/2 using sin(x) = sin(pi - x) */
+	if (x > 0x40000000)
+		x = 0x80000000LL - x;
+	else if (x < -0x40000000)
+		x = -0x80000000LL - x;
+	float t = x * (1.0f / 0x40000000), t2 = t * t;
+	return t * (1.5707963f + t2 * (-0.6459641f + t2 * (0.0796926f + t2 * -0.0046818f)));
+}
+
+/* Ways to compute the sine in the inner loop */
+#define SINE_TABLE 0
+#define SINE_POLY 1
+#define SINE_QUARTER 2
+#define SINE_INTERP 3
+#define SINE_MODES 4
+
+/* Lookup from a quarter wave table with bits of phase: the second
+ * quarter is the first one mirrored and the second half is negated */
+static inline int16_t tx_quarter_sine(const int16_t *qsine, uint64_t ph, unsigned bits)
+{
+	const uint32_t i = ph >> (64 - bits), q = 1U << (bits - 2);
+	uint32_t j = i & (q - 1);
+	if (i & q)
+		j = q - j;
+	return (i & (2 * q)) ? -qsine[j] : qsine[j];
+}
+
+/* Linear interpolation in a quarter wave table of 2^qbits intervals,
+ * from the upper 32 bits of the phase. It is folded to -pi/2...pi/2 as
+ * in tx_poly_sine, the magnitude selects an interval and the next 16
+ * bits interpolate in it. The error of a 256 interval table is about
+ * -100 dB, so there are no phase truncation spurs to dither away. */
+static inline int32_t tx_interp_sine(const int32_t *isine, uint32_t x, unsigned qbits)
+{
+	int32_t y = (int32_t)(x + 0x40000000U), sign;
+	sign = y >> 31;
+	y = (int32_t)((uint32_t)((y ^ sign) - sign) - 0x40000000U);
+	sign = y >> 31;
+	uint32_t a = (y ^ sign) - sign;
+	int32_t e = isine[a >> (30 - qbits)];
+	int32_t f = (a >> (14 - qbits)) & 0xFFFF;
+	int32_t v = (int16_t)e + (((e >> 16) * f + 0x8000) >> 16);
+	return (v ^ sign) - sign;
+}
+
+/* Generic inner loop computing n samples for each output.
+ * The flags are compile-time constants in every instance below,
+ * so unused features get optimized away:
+ * nch:    number of outputs computed (1-3), the rest stay idle
+ * shift:  compute outputs with phase shifts, otherwise copy output 0
+ * dither: type of dithering
+ * mode:   sine from the table, polynomial, quarter wave table or
+ *         interpolated quarter wave table */
+static inline __attribute__((always_inline))
+void tx_kernel(struct transmitter *tx, int8_t *b, unsigned long n,
+	const int nch, const int shift, const int dither, const int mode)
+{
+	unsigned long i;
+	const int poly = mode == SINE_POLY;
+
+	/* Copy most often used struct members to local variables */
+	uint64_t tx_phase = tx->phase, lcg = tx->lcg;
+	const uint64_t tx_freq = tx->freq;
+	uint64_t phs1 = tx->phs1, phs2 = tx->phs2;
+	const uint64_t dphs1 = tx->dphs1, dphs2 = tx->dphs2;
+	const int16_t *sine = tx->sine, *qsine = tx->qsine;
+	const int32_t *isine = tx->isine;
+	const unsigned bits = tx->sine_bits, sh = 64 - bits;
+	const float amp = tx->amp * 0x7EFF;
+	for (i = 0; i < n; i++) {
+		uint32_t rnd[3] = { 0 };
+		if (dither)
+			tx_dither_rand(dither, &lcg, rnd);
+		tx_phase += tx_freq;
+		if (shift) {
+			phs1 += dphs1;
+			phs2 += dphs2;
+		}
+		uint64_t ph = tx_phase;
+		/* Add phase dithering of one table step before
+		 * truncation to sine table size */
+		if (tx_dither_phase(dither) && (mode == SINE_TABLE || mode == SINE_QUARTER))
+			ph += (uint64_t)rnd[0] << (32 - bits);
+		/* Outputs with different phase shifts */
+		int32_t out0, out1 = 0, out2 = 0;
+		if (poly) {
+			out0 = amp * tx_poly_sine(ph);
+			if (nch >= 2)
+				out1 = shift ? amp * tx_poly_sine(ph + phs1) : out0;
+			if (nch >= 3)
+				out2 = shift ? amp * tx_poly_sine(ph + phs2) : out0;
+		} else if (mode == SINE_INTERP) {
+			out0 = tx_interp_sine(isine, ph >> 32, bits - 2);
+			if (nch >= 2)
+				out1 = shift ? tx_interp_sine(isine, (ph + phs1) >> 32, bits - 2) : out0;
+			if (nch >= 3)
+				out2 = shift ? tx_interp_sine(isine, (ph + phs2) >> 32, bits - 2) : out0;
+		} else if (mode == SINE_QUARTER) {
+			out0 = tx_quarter_sine(qsine, ph, bits);
+			if (nch >= 2)
+				out1 = shift ? tx_quarter_sine(qsine, ph + phs1, bits) : out0;
+			if (nch >= 3)
+				out2 = shift ? tx_quarter_sine(qsine, ph + phs2, bits) : out0;
+		} else {
+			out0 = sine[ph >> sh];
+			if (nch >= 2)
+				out1 = shift ? sine[(ph + phs1) >> sh] : out0;
+			if (nch >= 3)
+				out2 = shift ? sine[(ph + phs2) >> sh] : out0;
+		}
+		/* Add dithering to output values */
+		if (tx_dither_amp(dither)) {
+			out0 += tx_dither_value(dither, rnd, 0);
+			out1 += tx_dither_value(dither, rnd, 1);
+			out2 += tx_dither_value(dither, rnd, 2);
+			if (dither == DITHER_TPDF || dither == DITHER_HP) {
+				out0 = tx_dither_clamp(out0);
+				out1 = tx_dither_clamp(out1);
+				out2 = tx_dither_clamp(out2);
+			}
+		}
+		/* Quantization to 8 bits */
+		b[i] = (uint16_t)(0x7F00 + out0) >> 8;
+		if (nch >= 2)
+			b[i + FL2K_BUF_LEN] = (uint16_t)(0x7F00 + out1) >> 8;
+		if (nch >= 3)
+			b[i + FL2K_BUF_LEN*2] = (uint16_t)(0x7F00 + out2) >> 8;
+	}
+	tx->phase = tx_phase;
+	tx->lcg = lcg;
+	if (shift) {
+		tx->phs1 = phs1;
+		tx->phs2 = phs2;
+	}
+}
+
+/* Polynomial and interpolating inner loops on vectors of TX_VEC_N
+ * samples, written with the GCC/Clang vector extensions, so the same
+ * code compiles to SSE or AVX on x86 and to NEON or SVE on ARM. The
+ * results are the same as from tx_kernel. There is no portable gather,
+ * so the interpolation table is read lane by lane, but it is one load
+ * per sample and the rest is vector arithmetic. Plain table lookups
+ * are left to the scalar loop. */
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_convertvector)
+#define TX_VEC 1
+#endif
+#endif
+
+#ifdef TX_VEC
+/* As wide as the vector registers, 256 bits with AVX and otherwise
+ * 128, since wider vectors are passed to functions differently
+ * depending on the target */
+#if defined(__AVX__)
+#define TX_VEC_N 8
+#else
+#define TX_VEC_N 4
+#endif
+/* Only 32-bit lanes are used, since 64-bit shifts and multiplies are
+ * missing from some vector instruction sets */
+typedef uint32_t tx_vu32 __attribute__((vector_size(4 * TX_VEC_N)));
+typedef int32_t tx_vi32 __attribute__((vector_size(4 * TX_VEC_N)));
+typedef float tx_vf32 __attribute__((vector_size(4 * TX_VEC_N)));
+typedef uint16_t tx_vu16 __attribute__((vector_size(2 * TX_VEC_N)));
+typedef uint8_t tx_vu8 __attribute__((vector_size(TX_VEC_N)));
+
+#if defined(__AVX512F__)
+#define TX_VEC_ISA "AVX-512"
+#elif defined(__AVX2__)
+#define TX_VEC_ISA "AVX2"
+#elif defined(__AVX__)
+#define TX_VEC_ISA "AVX"
+#elif defined(__SSE2__)
+#define TX_VEC_ISA "SSE2"
+#elif defined(__ARM_FEATURE_SVE)
+#define TX_VEC_ISA "SVE"
+#elif defined(__ARM_NEON)
+#define TX_VEC_ISA "NEON"
+#else
+#define TX_VEC_ISA "generic"
+#endif
+
+/* Upper 32 bits of the phases ph + k, given the halves of ph
+ * and of the per lane offsets k */
+static inline __attribute__((always_inline))
+tx_vi32 tx_vec_phase(uint64_t ph, tx_vu32 k_hi, tx_vu32 k_lo)
+{
+	tx_vu32 lo = (uint32_t)ph + k_lo;
+	/* The comparison gives -1 where the lower halves carried. It is
+	 * done signed with the sign bits flipped, since SSE2 only has
+	 * signed comparisons and would otherwise get scalar code. */
+	tx_vi32 carry = (tx_vi32)(lo ^ 0x80000000U) < (tx_vi32)(k_lo ^ 0x80000000U);
+	return (tx_vi32)((uint32_t)(ph >> 32) + k_hi) - carry;
+}
+
+/* tx_poly_sine on a vector of upper halves of phases */
+static inline __attribute__((always_inline)) tx_vf32 tx_vec_poly_sine(tx_vi32 x)
+{
+	/* The same fold as in tx_poly_sine without comparisons, which are
+	 * not all available on every vector instruction set: |x + pi/2|
+	 * - pi/2 in 32-bit wrapping arithmetic gives the same values */
+	tx_vi32 v = (tx_vi32)((tx_vu32)x + 0x40000000U), sign = v >> 31;
+	x = (tx_vi32)((tx_vu32)((v ^ sign) - sign) - 0x40000000U);
+	tx_vf32 t = __builtin_convertvector(x, tx_vf32) * (1.0f / 0x40000000), t2 = t * t;
+	return t * (1.5707963f + t2 * (-0.6459641f + t2 * (0.0796926f + t2 * -0.0046818f)));
+}
+
+/* tx_interp_sine on a vector of upper halves of phases */
+static inline __attribute__((always_inline))
+tx_vi32 tx_vec_interp_sine(const int32_t *isine, tx_vi32 x, unsigned qbits)
+{
+	unsigned j;
+	tx_vi32 y = (tx_vi32)((tx_vu32)x + 0x40000000U), sign = y >> 31, e;
+	y = (tx_vi32)((tx_vu32)((y ^ sign) - sign) - 0x40000000U);
+	sign = y >> 31;
+	tx_vu32 a = (tx_vu32)((y ^ sign) - sign), i = a >> (30 - qbits);
+	for (j = 0; j < TX_VEC_N; j++)
+		e[j] = isine[i[j]];
+	tx_vi32 f = (tx_vi32)((a >> (14 - qbits)) & 0xFFFF);
+	tx_vi32 v = ((e << 16) >> 16) + (((e >> 16) * f + 0x8000) >> 16);
+	return (v ^ sign) - sign;
+}
+
+/* Dither numbers for TX_VEC_N samples. The generator is sequential,
+ * so they are made one by one, but the rest is vector arithmetic. */
+static inline __attribute__((always_inline))
+void tx_vec_dither_rand(const int dither, uint64_t *lcg, tx_vu32 r[3])
+{
+	unsigned j;
+	uint32_t s[3], v[3][TX_VEC_N];
+	for (j = 0; j < TX_VEC_N; j++) {
+		tx_dither_rand(dither, lcg, s);
+		v[0][j] = s[0];
+		v[1][j] = s[1];
+		v[2][j] = s[2];
+	}
+	memcpy(r, v, sizeof(v));
+}
+
+/* tx_dither_value on vectors */
+static inline __attribute__((always_inline))
+tx_vi32 tx_vec_dither_value(const int dither, const tx_vu32 r[3], unsigned c)
+{
+	const unsigned sh = 8 * c;
+	if (dither == DITHER_TPDF)
+		return (tx_vi32)(0xFF & r[0] >> sh) + (tx_vi32)(0xFF & r[2] >> sh) - 0x7F;
+	if (dither == DITHER_HP)
+		return (tx_vi32)(0xFF & r[0] >> sh) - (tx_vi32)(0xFF & r[1] >> sh) + 0x80;
+	return (tx_vi32)(0xFF & r[0] >> sh);
+}
+
+/* tx_dither_clamp on vectors */
+static inline __attribute__((always_inline)) tx_vi32 tx_vec_dither_clamp(tx_vi32 v)
+{
+	v += 0x7F00;
+	v &= ~(v >> 31);
+	v = 0xFFFF - v;
+	v &= ~(v >> 31);
+	return 0x80FF - v;
+}
+
+/* Sine of a vector of upper halves of phases, scaled to the output */
+static inline __attribute__((always_inline))
+tx_vi32 tx_vec_sine(tx_vi32 x, const int mode, float amp, const int32_t *isine, unsigned qbits)
+{
+	if (mode == SINE_INTERP)
+		return tx_vec_interp_sine(isine, x, qbits);
+	return __builtin_convertvector(amp * tx_vec_poly_sine(x), tx_vi32);
+}
+
+/* Quantize and store TX_VEC_N samples */
+static inline __attribute__((always_inline)) void tx_vec_store(int8_t *b, tx_vi32 out)
+{
+	/* Narrowing in two steps maps to packing instructions */
+	tx_vu16 h = __builtin_convertvector((tx_vu32)(out + 0x7F00) >> 8, tx_vu16);
+	tx_vu8 q = __builtin_convertvector(h, tx_vu8);
+	memcpy(b, &q, sizeof(q));
+}
+
+static inline __attribute__((always_inline))
+void tx_kernel_vec(struct transmitter *tx, int8_t *b, unsigned long n,
+	const int nch, const int shift, const int dither, const int mode)
+{
+	unsigned long i, nv = n - n % TX_VEC_N;
+	unsigned j;
+	uint64_t ph = tx->phase, lcg = tx->lcg;
+	const uint64_t freq = tx->freq;
+	uint64_t phs1 = tx->phs1, phs2 = tx->phs2;
+	const uint64_t dphs1 = tx->dphs1, dphs2 = tx->dphs2;
+	const float amp = tx->amp * 0x7EFF;
+	const int32_t *isine = tx->isine;
+	const unsigned qbits = tx->sine_bits - 2;
+	/* Phase offset of lane j from the start of the vector,
+	 * for each output with its frequency offset */
+	tx_vu32 k_hi, k_lo, k1_hi, k1_lo, k2_hi, k2_lo;
+	for (j = 0; j < TX_VEC_N; j++) {
+		k_hi[j] = ((j + 1) * freq) >> 32;
+		k_lo[j] = (j + 1) * freq;
+		k1_hi[j] = ((j + 1) * (freq + dphs1)) >> 32;
+		k1_lo[j] = (j + 1) * (freq + dphs1);
+		k2_hi[j] = ((j + 1) * (freq + dphs2)) >> 32;
+		k2_lo[j] = (j + 1) * (freq + dphs2);
+	}
+	for (i = 0; i < nv; i += TX_VEC_N) {
+		tx_vu32 rnd[3];
+		if (dither)
+			tx_vec_dither_rand(dither, &lcg, rnd);
+		tx_vi32 out0, out1 = { 0 }, out2 = { 0 };
+		out0 = tx_vec_sine(tx_vec_phase(ph, k_hi, k_lo), mode, amp, isine, qbits);
+		if (nch >= 2)
+			out1 = shift ? tx_vec_sine(tx_vec_phase(ph + phs1, k1_hi, k1_lo),
+				mode, amp, isine, qbits) : out0;
+		if (nch >= 3)
+			out2 = shift ? tx_vec_sine(tx_vec_phase(ph + phs2, k2_hi, k2_lo),
+				mode, amp, isine, qbits) : out0;
+		if (tx_dither_amp(dither)) {
+			out0 += tx_vec_dither_value(dither, rnd, 0);
+			out1 += tx_vec_dither_value(dither, rnd, 1);
+			out2 += tx_vec_dither_value(dither, rnd, 2);
+			if (dither == DITHER_TPDF || dither == DITHER_HP) {
+				out0 = tx_vec_dither_clamp(out0);
+				out1 = tx_vec_dither_clamp(out1);
+				out2 = tx_vec_dither_clamp(out2);
+			}
+		}
+		tx_vec_store(b + i, out0);
+		if (nch >= 2)
+			tx_vec_store(b + i + FL2K_BUF_LEN, out1);
+		if (nch >= 3)
+			tx_vec_store(b + i + FL2K_BUF_LEN*2, out2);
+		ph += TX_VEC_N * freq;
+		if (shift) {
+			phs1 += TX_VEC_N * dphs1;
+			phs2 += TX_VEC_N * dphs2;
+		}
+	}
+	tx->phase = ph;
+	tx->lcg = lcg;
+	if (shift) {
+		tx->phs1 = phs1;
+		tx->phs2 = phs2;
+	}
+	/* The rest with the scalar loop */
+	tx_kernel(tx, b + nv, n - nv, nch, shift, dither, mode);
+}
+#else
+#define TX_VEC_ISA "none"
+#define tx_kernel_vec(tx, b, n, nch, shift, dither, mode) tx_kernel(tx, b, n, nch, shift, dither, mode)
+#endif
+
+/* Combined DAC: R, G and B summed through resistors, so that G has
+ * 1/cwg and B 1/cwb of the weight of R. Each sample is quantized on R,
+ * the rest of it on G and what is still left on B, so B steps are
+ * 1/cwb of R steps. The levels are the measured outputs of each code
+ * in steps of the channel, so the rest carried to the next channel
+ * also corrects the mismatch of the DACs. */
+struct combine {
+	float gain[2]; // Weight of R relative to G, of G relative to B
+	float level[3][256];
+};
+
+/* Set up the combined DAC. The calibration file, if given, has a line
+ * for each code with the levels of R, G and B. Returns NULL if it
+ * cannot be read. */
+struct combine *combine_init(double wg, double wb, const char *cal)
+{
+	unsigned c, i;
+	struct combine *cb = calloc(1, sizeof(*cb));
+	cb->gain[0] = wg;
+	cb->gain[1] = wb / wg;
+	for (c = 0; c < 3; c++)
+		for (i = 0; i < 256; i++)
+			cb->level[c][i] = i;
+	if (cal) {
+		FILE *f = fopen(cal, "r");
+		if (f == NULL) {
+			free(cb);
+			return NULL;
+		}
+		for (i = 0; i < 256; i++)
+			if (fscanf(f, "%f %f %f", &cb->level[0][i], &cb->level[1][i], &cb->level[2][i]) != 3)
+				break;
+		fclose(f);
+		if (i < 256) {
+			free(cb);
+			return NULL;
+		}
+	}
+	return cb;
+}
+
+/* Clamp to a code without comparisons, like the vector version */
+static inline int32_t tx_combine_code(int32_t c)
+{
+	c &= ~(c >> 31);
+	c = 255 - c;
+	return 255 - (c & ~(c >> 31));
+}
+
+#ifdef TX_VEC
+static inline __attribute__((always_inline)) tx_vi32 tx_vec_combine_code(tx_vi32 c)
+{
+	c &= ~(c >> 31);
+	c = 255 - c;
+	return 255 - (c & ~(c >> 31));
+}
+
+/* Levels of a vector of codes, read lane by lane */
+static inline __attribute__((always_inline)) tx_vf32 tx_vec_level(const float *level, tx_vi32 c)
+{
+	unsigned j;
+	tx_vf32 l;
+	for (j = 0; j < TX_VEC_N; j++)
+		l[j] = level[c[j]];
+	return l;
+}
+
+/* Store TX_VEC_N codes */
+static inline __attribute__((always_inline)) void tx_vec_store_codes(int8_t *b, tx_vi32 c)
+{
+	tx_vu16 h = __builtin_convertvector((tx_vu32)c, tx_vu16);
+	tx_vu8 q = __builtin_convertvector(h, tx_vu8);
+	memcpy(b, &q, sizeof(q));
+}
+#endif
+
+/* Inner loop for the combined DAC. The sine is computed in float by
+ * the polynomial, since a table has too few bits. Dithering is only
+ * needed on B, the last channel. */
+static inline __attribute__((always_inline))
+void tx_kernel_combine(struct transmitter *tx, int8_t *b, unsigned long n, const int dither)
+{
+	unsigned long i = 0;
+	uint64_t ph = tx->phase, lcg = tx->lcg;
+	const uint64_t freq = tx->freq;
+	const struct combine *cb = tx->comb;
+	const float amp = tx->amp * (0x7EFF / 256.0f);
+#ifdef TX_VEC
+	unsigned long nv = n - n % TX_VEC_N;
+	unsigned j;
+	tx_vu32 k_hi, k_lo;
+	for (j = 0; j < TX_VEC_N; j++) {
+		k_hi[j] = ((j + 1) * freq) >> 32;
+		k_lo[j] = (j + 1) * freq;
+	}
+	for (; i < nv; i += TX_VEC_N) {
+		tx_vu32 rnd[3];
+		tx_vi32 d = { 0 };
+		d += 0x80;
+		if (dither)
+			tx_vec_dither_rand(dither, &lcg, rnd);
+		if (tx_dither_amp(dither))
+			d = tx_vec_dither_value(dither, rnd, 0);
+		tx_vf32 x = 127 + amp * tx_vec_poly_sine(tx_vec_phase(ph, k_hi, k_lo));
+		tx_vi32 r = tx_vec_combine_code(__builtin_convertvector(x + 0.5f, tx_vi32));
+		x = (x - tx_vec_level(cb->level[0], r)) * cb->gain[0] + 128;
+		tx_vi32 g = tx_vec_combine_code(__builtin_convertvector(x + 0.5f, tx_vi32));
+		x = (x - tx_vec_level(cb->level[1], g)) * cb->gain[1] + 128;
+		tx_vi32 bl = tx_vec_combine_code(__builtin_convertvector(
+			x + __builtin_convertvector(d, tx_vf32) * (1.0f / 256), tx_vi32));
+		tx_vec_store_codes(b + i, r);
+		tx_vec_store_codes(b + i + FL2K_BUF_LEN, g);
+		tx_vec_store_codes(b + i + FL2K_BUF_LEN*2, bl);
+		ph += TX_VEC_N * freq;
+	}
+#endif
+	for (; i < n; i++) {
+		uint32_t rnd[3];
+		int32_t d = 0x80;
+		if (dither)
+			tx_dither_rand(dither, &lcg, rnd);
+		if (tx_dither_amp(dither))
+			d = tx_dither_value(dither, rnd, 0);
+		ph += freq;
+		float x = 127 + amp * tx_poly_sine(ph);
+		int32_t r = tx_combine_code(x + 0.5f);
+		x = (x - cb->level[0][r]) * cb->gain[0] + 128;
+		int32_t g = tx_combine_code(x + 0.5f);
+		x = (x - cb->level[1][g]) * cb->gain[1] + 128;
+		int32_t bl = tx_combine_code(x + d * (1.0f / 256));
+		b[i] = r;
+		b[i + FL2K_BUF_LEN] = g;
+		b[i + FL2K_BUF_LEN*2] = bl;
+	}
+	tx->phase = ph;
+	tx->lcg = lcg;
+}
+
+#define TX_KERNEL_COMBINE(dither) \
+static void tx_kernel_combine##dither(struct transmitter *tx, int8_t *b, unsigned long n) \
+{ \
+	tx_kernel_combine(tx, b, n, dither); \
+}
+TX_KERNEL_COMBINE(0)
+TX_KERNEL_COMBINE(1)
+TX_KERNEL_COMBINE(2)
+TX_KERNEL_COMBINE(3)
+TX_KERNEL_COMBINE(4)
+TX_KERNEL_COMBINE(5)
+static const tx_kernel_t tx_kernels_combine[DITHER_TYPES] = {
+	tx_kernel_combine0, tx_kernel_combine1, tx_kernel_combine2,
+	tx_kernel_combine3, tx_kernel_combine4, tx_kernel_combine5
+};
+
+#define TX_KERNEL(nch, shift, dither, mode) \
+static void tx_kernel_##nch##shift##dither##mode( \
+	struct transmitter *tx, int8_t *b, unsigned long n) \
+{ \
+	if (mode == SINE_POLY || mode == SINE_INTERP) \
+		tx_kernel_vec(tx, b, n, nch, shift, dither, mode); \
+	else \
+		tx_kernel(tx, b, n, nch, shift, dither, mode); \
+}
+#define TX_KERNELS(dither, mode) \
+	TX_KERNEL(1, 0, dither, mode) \
+	TX_KERNEL(2, 0, dither, mode) \
+	TX_KERNEL(3, 0, dither, mode) \
+	TX_KERNEL(2, 1, dither, mode) \
+	TX_KERNEL(3, 1, dither, mode)
+#define TX_KERNELS_MODE(mode) \
+	TX_KERNELS(0, mode) \
+	TX_KERNELS(1, mode) \
+	TX_KERNELS(2, mode) \
+	TX_KERNELS(3, mode) \
+	TX_KERNELS(4, mode) \
+	TX_KERNELS(5, mode)
+TX_KERNELS_MODE(0)
+TX_KERNELS_MODE(1)
+TX_KERNELS_MODE(2)
+TX_KERNELS_MODE(3)
+
+/* Indexed by [mode][dither][shift][nch-1].
+ * With a single output there is nothing to phase shift. */
+#define TX_KERNEL_ROW(dither, mode) { \
+	{ tx_kernel_10##dither##mode, tx_kernel_20##dither##mode, tx_kernel_30##dither##mode }, \
+	{ tx_kernel_10##dither##mode, tx_kernel_21##dither##mode, tx_kernel_31##dither##mode } }
+#define TX_KERNEL_ROWS(mode) { \
+	TX_KERNEL_ROW(0, mode), TX_KERNEL_ROW(1, mode), TX_KERNEL_ROW(2, mode), \
+	TX_KERNEL_ROW(3, mode), TX_KERNEL_ROW(4, mode), TX_KERNEL_ROW(5, mode) }
+static const tx_kernel_t tx_kernels[SINE_MODES][DITHER_TYPES][2][3] = {
+	TX_KERNEL_ROWS(0),
+	TX_KERNEL_ROWS(1),
+	TX_KERNEL_ROWS(2),
+	TX_KERNEL_ROWS(3)
+};
+
+/* Inner loop mode for the transmitter settings */
+static int tx_sine_mode(struct transmitter *tx)
+{
+	return tx->poly ? SINE_POLY : tx->interp ? SINE_INTERP :
+		tx->quarter ? SINE_QUARTER : SINE_TABLE;
+}
+
+/* Band-limited Gaussian noise.
+ * Complex Gaussian samples are computed by Box-Muller from a hash of
+ * their index, so any part of the noise can be computed independently.
+ * They are interpolated by NOISE_P with a polyphase filter, which also
+ * limits the bandwidth, to a rate of at least 8 times the bandwidth, and
+ * then linearly to fs. Interpolation images are then at least 47 dB
+ * down. The noise is mixed up to the band like the synthesizer. */
+#define NOISE_P 4 // Interpolation factor of the polyphase filter
+#define NOISE_T 32 // Taps per phase
+
+struct noise {
+	unsigned long d; // Output samples per filtered sample
+	uint64_t seed;
+	uint64_t pos; // Output samples computed
+	float taps[NOISE_P][NOISE_T];
+	/* The same reversed and each twice, for filtering the Gaussian
+	 * samples as interleaved real and imaginary parts */
+	float rtaps[NOISE_P][2 * NOISE_T];
+	/* Space for ng Gaussian and nq filtered samples for each thread */
+	complex float **g, **y;
+	unsigned long ng, nq;
+};
+
+/* Natural logarithm of x > 0, with an error below 1e-7 */
+static inline float noise_log(float x)
+{
+	union { float f; uint32_t i; } v = { x };
+	int e = (int)(v.i >> 23) - 127;
+	/* Mantissa in [0.707, 1.414) */
+	v.i = (v.i & 0x7FFFFF) | 0x3F800000;
+	if (v.f > 1.41421356f) {
+		v.f *= 0.5f;
+		e++;
+	}
+	/* log(m) = 2 atanh((m-1)/(m+1)) */
+	float s = (v.f - 1.0f) / (v.f + 1.0f), s2 = s * s;
+	return e * 0.69314718f + 2.0f * s * (1.0f + s2 * (1.0f/3 + s2 * (1.0f/5 + s2 * (1.0f/7))));
+}
+
+/* splitmix64 output function */
+static inline uint64_t noise_hash(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/* Complex Gaussian sample number k, with unit variance per component */
+static inline complex float noise_gauss(uint64_t seed, int64_t k)
+{
+	uint64_t r = noise_hash(seed + k * 0x9E3779B97F4A7C15ULL);
+	/* 24 bits for the magnitude, never 0, and 32 for the phase */
+	float u = ((r >> 40) + 0.5f) * (1.0f / (1 << 24));
+	float mag = sqrtf(-2.0f * noise_log(u));
+	uint64_t ph = r << 32;
+	return mag * (tx_poly_sine(ph + (1ULL<<62)) + I * tx_poly_sine(ph));
+}
+
+/* Filtered sample from the Gaussian samples g[1-NOISE_T]...g[0]
+ * with phase p of the filter */
+static inline complex float noise_filter(const struct noise *ns, unsigned p,
+	const complex float *g)
+{
+#ifdef TX_VEC
+	const float *x = (const float *)(g + 1 - NOISE_T), *h = ns->rtaps[p];
+	tx_vf32 acc = { 0 }, v, w;
+	unsigned i;
+	float re = 0, im = 0;
+	for (i = 0; i < 2 * NOISE_T; i += TX_VEC_N) {
+		memcpy(&v, x + i, sizeof(v));
+		memcpy(&w, h + i, sizeof(w));
+		acc += v * w;
+	}
+	for (i = 0; i < TX_VEC_N; i += 2) {
+		re += acc[i];
+		im += acc[i + 1];
+	}
+	return re + I * im;
+#else
+	const float *h = ns->taps[p];
+	complex float acc = 0;
+	unsigned t;
+	for (t = 0; t < NOISE_T; t++)
+		acc += h[t] * g[-(int)t];
+	return acc;
+#endif
+}
+
+/* Set up noise of bandwidth bw (Hz) and RMS level relative to a full
+ * scale sine (dB). Returns NULL if the bandwidth is too wide. */
+struct noise *noise_init(double fs, double bw, double level, uint64_t seed, unsigned nparts)
+{
+	unsigned p, t, i;
+	unsigned long d = floor(fs / (8.0 * bw));
+	if (d < 1)
+		return NULL;
+	struct noise *ns = calloc(1, sizeof(*ns));
+	double fn = fs / d, fg = fn / NOISE_P;
+	ns->d = d;
+	ns->seed = noise_hash(seed);
+
+	/* Blackman windowed sinc */
+	const unsigned len = NOISE_P * NOISE_T;
+	double fc = 0.5 * bw;
+	double gain = 0, power = 0;
+	for (i = 0; i < len; i++) {
+		double x = i - 0.5 * (len - 1);
+		double w = 0.42 + 0.5 * cos(6.283185307179586 * x / len)
+			+ 0.08 * cos(12.566370614359172 * x / len);
+		double h = 2.0 * fc / fn * w;
+		if (x != 0)
+			h *= sin(6.283185307179586 * fc / fn * x) / (6.283185307179586 * fc / fn * x);
+		ns->taps[i % NOISE_P][i / NOISE_P] = h;
+	}
+	for (p = 0; p < NOISE_P; p++) {
+		double sum = 0;
+		for (t = 0; t < NOISE_T; t++) {
+			sum += ns->taps[p][t];
+			power += ns->taps[p][t] * ns->taps[p][t] / NOISE_P;
+		}
+		gain += sum / NOISE_P;
+	}
+	/* Scale for the wanted RMS level of complex noise
+	 * with a variance of 2 from the Gaussian samples */
+	double scale = sqrt(pow(10.0, 0.1 * level) / (2.0 * power));
+	for (p = 0; p < NOISE_P; p++)
+		for (t = 0; t < NOISE_T; t++)
+			ns->taps[p][t] *= scale;
+	for (p = 0; p < NOISE_P; p++)
+		for (t = 0; t < NOISE_T; t++)
+			ns->rtaps[p][2*t] = ns->rtaps[p][2*t + 1] = ns->taps[p][NOISE_T - 1 - t];
+
+	/* Equivalent noise bandwidth of the filter */
+	double enbw = fg * power / (gain * gain);
+	INFO("Noise: %.0f Hz wide, %.1f dBFS RMS, %.1f dBFS/Hz, "
+		"filtered at %.0f Hz and interpolated by %lu\n",
+		enbw, level, level - 10.0 * log10(enbw), fn, d);
+
+	/* A part of n <= FL2K_BUF_LEN samples starting anywhere needs
+	 * q2 - q1 + 1 <= (n - 1) / d + 3 filtered samples, which need
+	 * (q2 - q1) / NOISE_P + NOISE_T + 1 Gaussian samples at most */
+	ns->nq = (FL2K_BUF_LEN - 1) / d + 3;
+	ns->ng = (ns->nq - 1) / NOISE_P + NOISE_T + 1;
+	ns->g = calloc(nparts, sizeof(*ns->g));
+	ns->y = calloc(nparts, sizeof(*ns->y));
+	for (p = 0; p < nparts; p++) {
+		ns->g[p] = malloc(ns->ng * sizeof(**ns->g));
+		ns->y[p] = malloc(ns->nq * sizeof(**ns->y));
+	}
+	return ns;
+}
+
+/* Select the inner loop for the phase shifts and outputs in use */
+void tx_select_kernel(struct transmitter *tx)
+{
+	unsigned c, shift = tx->nch > 1 && (tx->phs1 != 0 || tx->phs2 != 0 || tx->phs_vary);
+	tx->nout = shift || !tx->share ? tx->nch : 1;
+	tx->kernel = tx_kernels[tx_sine_mode(tx)][(int)tx->dither][shift][tx->nout - 1];
+	/* All three outputs make one signal */
+	if (tx->comb) {
+		tx->nout = 3;
+		tx->kernel = tx_kernels_combine[(int)tx->dither];
+	}
+	for (c = 0; c < 3; c++) {
+		if (c >= tx->nch)
+			tx->out[c] = tx->idle;
+		else if (c >= tx->nout)
+			tx->out[c] = tx->buf; // Same samples as the first output
+		else
+			tx->out[c] = tx->buf + FL2K_BUF_LEN*c;
+	}
+}
+
+void tx_start(struct transmitter *tx)
+{
+	unsigned band = tx->wspr_freq_i;
+	tx->wspr_i = 0;
+	tx->wspr_symphase = 0;
+	tx->phase = 0;
+	if (tx->nmsgs) {
+		unsigned *i = &tx->msg_i[tx->rotate ? band : 0];
+		tx->wspr_data = tx->msgs[*i];
+		INFO("Sending message %u\n", *i);
+		*i = (*i + 1) % tx->nmsgs;
+	}
+	tx->wspr_freq = tx->wspr_freqs[tx->wspr_freq_i];
+	tx->freq = tx->wspr_freq + tx->wspr_step * (tx->wspr_data[0] - '0');
+	tx_use_sine(tx, band);
+	INFO("Starting WPSR transmission on band %d\n", tx->wspr_freq_i);
+	tx->sent[band]++;
+	tx->wspr_freq_i = (tx->wspr_freq_i + 1) % tx->wspr_nfreqs;
+	if (tx->ps == 1)
+		tx->swapped = !tx->swapped;
+	tx_plan_phases(tx);
+	tx->slot++;
+	/* The fraction of a sample of the delay is done by the phase */
+	tx->phase = tx_deg_to_phase(tx->dphase -
+		360.0 * tx->wspr_hz[band] * (tx->delay - floor(tx->delay)) / tx->fs);
+	tx->phase += tx->phs_plan[0][0];
+	tx_select_kernel(tx);
+	if (tx->synth) {
+		tx->freq = tx->wspr_freq;
+		synth_start(tx->synth, tx->wspr_data, tx->wspr_hz[band]);
+	}
+	tx->wspr_on = 1;
+}
+
+/* Continuous carrier on the first band.
+ * Without dithering, the output repeats exactly after 2^k samples,
+ * where 64-k is the number of trailing zero bits in the tuning word.
+ * Find the shortest such period within the allowed frequency error,
+ * compute it once, followed by one more buffer so that any buffer
+ * is a contiguous piece of it, and rotate through it. */
+void tx_tune(struct transmitter *tx, struct configuration *conf)
+{
+	unsigned k, c;
+	unsigned long i, n;
+	tx->phase = 0;
+	tx->freq = tx->wspr_freqs[0];
+	tx_plan_phases(tx);
+	tx_select_kernel(tx);
+	tx->wspr_on = 1;
+	INFO("Transmitting carrier on %.1f Hz\n", conf->f[0]);
+	if (tx->dither) {
+		INFO("Dithering is enabled, so the carrier is not cached\n");
+		return;
+	}
+	if (tx->dphs1 != 0 || tx->dphs2 != 0) {
+		INFO("Outputs have frequency offsets, so the carrier is not cached\n");
+		return;
+	}
+
+	for (k = 1; k <= CACHE_SHIFT; k++) {
+		uint64_t step = 1ULL << (64 - k);
+		uint64_t f = (tx->freq + (step >> 1)) & ~(step - 1);
+		double err = (int64_t)(f - tx->freq) * (tx->fs / ((double)(1ULL<<63) * 2.0));
+		if (f != 0 && fabs(err) <= conf->snap) {
+			if (f != tx->freq)
+				INFO("Carrier moved by %.3f Hz to make it periodic\n", err);
+			tx->freq = f;
+			break;
+		}
+	}
+	if (k > CACHE_SHIFT) {
+		INFO("No periodic carrier within %.3f Hz, carrier is not cached\n", conf->snap);
+		return;
+	}
+
+	tx->cache_period = 1UL << k;
+	tx->cache_len = tx->cache_period + FL2K_BUF_LEN;
+	tx->cache = malloc(tx->cache_len * tx->nout);
+	for (i = 0; i < tx->cache_len; i += n) {
+		n = tx->cache_len - i;
+		if (n > FL2K_BUF_LEN)
+			n = FL2K_BUF_LEN;
+		tx->kernel(tx, tx->buf, n);
+		for (c = 0; c < tx->nout; c++)
+			memcpy(tx->cache + tx->cache_len*c + i, tx->buf + FL2K_BUF_LEN*c, n);
+	}
+	for (c = 0; c < 3; c++)
+		if (tx->out[c] != tx->idle)
+			tx->out[c] = tx->cache + (tx->out[c] - tx->buf) / FL2K_BUF_LEN * tx->cache_len;
+	tx->cache_pos = 0;
+	INFO("Carrier period of %lu samples cached\n", tx->cache_period);
+}
+
+/* Equal tones around the first band for intermodulation measurements.
+ * Tone k starts at phase pi k^2 / N (Schroeder), which keeps the crest
+ * factor of the sum low, and the gain is set from the actual peak of
+ * the envelope so that the sum never exceeds full scale. */
+void tx_tones(struct transmitter *tx, struct configuration *conf)
+{
+	unsigned k, i, n = conf->tones;
+	const unsigned len = 8192;
+	double peak = 0;
+	tx->ntones = n;
+	for (k = 0; k < n; k++) {
+		double hz = conf->f[0] + (k - 0.5 * (n - 1)) * conf->spacing;
+		tx->tone_freq[k] = tx_hz_to_freq(tx, hz);
+		tx->tone_phase[k] = (uint64_t)((k * k % (2 * n)) * ((double)(1ULL<<63) / n));
+	}
+	/* The envelope repeats at the tone spacing */
+	for (i = 0; i < len; i++) {
+		complex double v = 0;
+		for (k = 0; k < n; k++)
+			v += cexp(I * M_PI * ((double)k * k / n + 2.0 * k * i / len));
+		if (cabs(v) > peak)
+			peak = cabs(v);
+	}
+	/* Leave room for rounding of the sine table values */
+	tx->tone_gain = 0.995 / peak;
+	tx->phase = 0;
+	tx_select_kernel(tx);
+	tx->wspr_on = 1;
+	INFO("Transmitting %u tones %.1f Hz apart around %.1f Hz, "
+		"each at %.1f dBFS, peak to average %.1f dB\n",
+		n, conf->spacing, conf->f[0], 20.0 * log10(tx->tone_gain * tx->amp),
+		20.0 * log10(peak / sqrt(n)));
+}
+
+/* Enable or disable non-temporal stores. The inner loops write planes
+ * FL2K_BUF_LEN apart, so a scratch area spans all of them, but only
+ * NT_BLOCK samples at the start of each plane are ever touched and
+ * stay in the cache. */
+void tx_set_nt(struct transmitter *tx, char nt)
+{
+	unsigned i, n = tx->workers ? tx->workers->n : 1;
+	tx->nt = nt;
+	if (!nt || tx->scratch)
+		return;
+	tx->scratch = calloc(n, sizeof(*tx->scratch));
+	for (i = 0; i < n; i++)
+		tx->scratch[i] = aligned_alloc(4096, FL2K_BUF_LEN * 2 + 2 * NT_BLOCK);
+}
+
+/* Copy n samples bypassing the cache where possible.
+ * dst and src have to be equally aligned. */
+static void tx_stream(int8_t *dst, const int8_t *src, unsigned long n)
+{
+#ifdef __SSE2__
+	for (; n > 0 && ((uintptr_t)dst & 15); n--)
+		*dst++ = *src++;
+	for (; n >= 16; n -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i*)dst, _mm_load_si128((const __m128i*)src));
+#endif
+	memcpy(dst, src, n);
+}
+
+/* Make the streaming stores visible before the buffer is handed over */
+static void tx_stream_fence(void)
+{
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
+
+/* Prepare everything that does not depend on the exact sample rate.
+ * This is done before streaming starts, so the callback can send idle
+ * samples from the first buffer on, until tx_init has run. */
+void tx_prepare(struct transmitter *tx, struct configuration *conf)
+{
+	/* Planes aligned to pages for the streaming stores */
+	tx->buf = aligned_alloc(4096, FL2K_BUF_LEN * 4);
+	tx->idle = tx->buf + FL2K_BUF_LEN*3;
+	memset(tx->idle, 0x80, FL2K_BUF_LEN);
+	tx->nch = conf->ch;
+	tx->dither = conf->dither;
+	tx->poly = conf->poly;
+	tx->share = conf->share;
+	tx->tune = conf->tune;
+	if (conf->threads != 1)
+		tx->workers = workers_init(conf->threads);
+	tx_set_nt(tx, conf->nt);
+	/* The full wave table is read by the plain table loop, and by the
+	 * mixer of the synthesizer and noise and the tones whatever the
+	 * loop; bench tries every loop */
+	tx->sine_full = conf->bench || conf->ns > 0 || conf->noise > 0 ||
+		(conf->tones > 0 && !conf->poly) ||
+		(!conf->poly && !conf->quarter && !conf->interp);
+	tx->nsine = conf->eq ? conf->nf : 1;
+	tx_alloc_sine(tx, conf->sinebits ? conf->sinebits :
+		conf->interp ? SINE_BITS_DEFAULT : tx_default_sine_bits(conf->quarter),
+		conf->quarter, conf->interp);
+	tx->wspr_on = 0;
+	tx->wspr_data = conf->s;
+	tx->rotate = conf->rotate;
+	tx->phs1 = tx->phs_base[0] = conf->p1 * ((double)(1ULL<<63) / 180.0);
+	tx->phs2 = tx->phs_base[1] = conf->p2 * ((double)(1ULL<<63) / 180.0);
+	tx->phs_step[0] = tx_deg_to_phase(conf->pstep1);
+	tx->phs_step[1] = tx_deg_to_phase(conf->pstep2);
+	tx->df[0] = conf->df1;
+	tx->df[1] = conf->df2;
+	tx->ps = conf->ps;
+	tx->sync = conf->sync;
+	tx->delay = conf->delay;
+	tx->dphase = conf->dphase;
+}
+
+/* Set up for the exact sample rate, once it is known */
+void tx_init(struct transmitter *tx, struct configuration *conf)
+{
+	tx->fs = conf->fs_exact;
+	tx->fs_nominal = conf->bfs[0];
+	if (conf->ns > 0)
+		tx->synth = synth_init(conf->ns, tx->fs, conf->sim, conf->seed);
+	if (conf->noise > 0)
+		tx->noise = noise_init(tx->fs, conf->noise, conf->nlevel, conf->seed,
+			tx->workers ? tx->workers->n : 1);
+	tx->wspr_step = tx_hz_to_freq(tx, 12000.0 / 8192);
+	tx_plan_bands(tx, conf);
+	tx_make_sine(tx);
+	tx_use_sine(tx, 0);
+	if (tx->tune)
+		tx_tune(tx, conf);
+	if (tx->noise) {
+		tx->phase = 0;
+		tx->freq = tx->wspr_freqs[0];
+		tx_select_kernel(tx);
+		tx->wspr_on = 1;
+		INFO("Transmitting noise on %.1f Hz\n", conf->f[0]);
+	}
+	if (conf->tones > 0)
+		tx_tones(tx, conf);
+	/* Publishes everything set up above to the callback thread */
+	__atomic_store_n(&tx->initialized, 1, __ATOMIC_RELEASE);
+}
+
+/* A part of a buffer computed by one thread */
+struct tx_job {
+	struct transmitter *tx;
+	int8_t *b;
+	unsigned long n; // Samples in the whole buffer
+	uint64_t phase, lcg; // State at the start of the buffer
+};
+
+/* Run the inner loop on n samples, through the scratch area if given */
+static void tx_kernel_span(struct transmitter *tx, int8_t *b, unsigned long n, int8_t *scratch)
+{
+	unsigned long i, m;
+	unsigned c;
+	if (scratch == NULL) {
+		tx->kernel(tx, b, n);
+		return;
+	}
+	for (i = 0; i < n; i += m) {
+		m = n - i < NT_BLOCK ? n - i : NT_BLOCK;
+		/* Same alignment in the scratch area as in the buffer */
+		int8_t *sc = scratch + ((uintptr_t)(b + i) & 15);
+		tx->kernel(tx, sc, m);
+		for (c = 0; c < tx->nout; c++)
+			tx_stream(b + i + FL2K_BUF_LEN*c, sc + FL2K_BUF_LEN*c, m);
+	}
+}
+
+/* Run the selected inner loop on one part of a buffer, on a copy of
+ * the transmitter state advanced to the start of the part */
+static void tx_kernel_part(void *arg, unsigned part, unsigned nparts)
+{
+	struct tx_job *job = arg;
+	const unsigned long start = job->n * part / nparts;
+	const unsigned long end = job->n * (part + 1) / nparts;
+	struct transmitter t = *job->tx;
+	if (start >= end)
+		return;
+	t.phase = job->phase + start * t.freq;
+	t.phs1 += start * t.dphs1;
+	t.phs2 += start * t.dphs2;
+	if (t.dither)
+		t.lcg = tx_dither_skip(t.dither, job->lcg, start);
+	tx_kernel_span(&t, job->b + start, end - start, t.nt ? t.scratch[part] : NULL);
+}
+
+/* Run the inner loop on n samples, in parallel if there are workers */
+void tx_kernel_run(struct transmitter *tx, int8_t *b, unsigned long n)
+{
+	struct tx_job job = { .tx = tx, .b = b, .n = n, .phase = tx->phase, .lcg = tx->lcg };
+	if (tx->workers == NULL) {
+		tx_kernel_span(tx, b, n, tx->nt ? tx->scratch[0] : NULL);
+		return;
+	}
+	workers_run(tx->workers, tx_kernel_part, &job);
+	tx->phase += n * tx->freq;
+	if (tx->nout > 1) {
+		tx->phs1 += n * tx->dphs1;
+		tx->phs2 += n * tx->dphs2;
+	}
+	if (tx->dither)
+		tx->lcg = tx_dither_skip(tx->dither, tx->lcg, n);
+}
+
+/* Mixing of complex baseband up to the band, for one part of a buffer */
+struct tx_mixer {
+	int8_t *b;
+	uint64_t freq, phs[3];
+	const int16_t *sine;
+	unsigned bits, nout;
+	char dither;
+	uint64_t phase, lcg; // State before the next sample
+};
+
+static void tx_mixer_init(struct tx_mixer *m, struct tx_job *job, unsigned long start)
+{
+	struct transmitter *tx = job->tx;
+	m->b = job->b;
+	m->freq = tx->freq;
+	m->phs[0] = 0;
+	m->phs[1] = tx->phs1;
+	m->phs[2] = tx->phs2;
+	m->sine = tx->sine;
+	m->bits = tx->sine_bits;
+	m->nout = tx->nout;
+	m->dither = tx->dither;
+	m->phase = job->phase + start * m->freq;
+	m->lcg = m->dither ? tx_dither_skip(m->dither, job->lcg, start) : 0;
+}
+
+/* Compute samples j1...j2-1 of the buffer from baseband interpolated
+ * linearly along a segment with value v0 at its start, changing by dv
+ * every sample. Sample j1 is sample k of the segment. */
+static inline void tx_mix(struct tx_mixer *m, unsigned long j1, unsigned long j2,
+	unsigned long k, const complex float v0, const complex float dv)
+{
+	unsigned long j;
+	unsigned c;
+	int8_t *b = m->b;
+	uint64_t tx_phase = m->phase, lcg = m->lcg;
+	const uint64_t tx_freq = m->freq;
+	const int16_t *sine = m->sine;
+	const unsigned bits = m->bits;
+	const unsigned nout = m->nout;
+	const char dither = m->dither;
+	for (j = j1; j < j2; j++) {
+		uint32_t rnd[3] = { 0 };
+		if (dither)
+			tx_dither_rand(dither, &lcg, rnd);
+		tx_phase += tx_freq;
+		uint64_t ph = tx_phase;
+		if (tx_dither_phase(dither))
+			ph += (uint64_t)rnd[0] << (32 - bits);
+		/* From the start of the segment, so the values do not
+		 * depend on where the parts of the buffer begin */
+		const complex float v = v0 + dv * (float)(k + j - j1);
+		float re = crealf(v), im = cimagf(v);
+		for (c = 0; c < nout; c++) {
+			uint64_t p = ph + m->phs[c];
+			int32_t out = re * sine[(p + (1ULL<<62)) >> (64 - bits)]
+			            - im * sine[p >> (64 - bits)];
+			/* Clip peaks */
+			if (out > 0x7EFF)
+				out = 0x7EFF;
+			if (out < -0x7EFF)
+				out = -0x7EFF;
+			if (tx_dither_amp(dither))
+				out = tx_dither_clamp(out + tx_dither_value(dither, rnd, c));
+			b[j + FL2K_BUF_LEN*c] = (uint16_t)(0x7F00 + out) >> 8;
+		}
+	}
+	m->phase = tx_phase;
+	m->lcg = lcg;
+}
+
+/* Mix the synthesizer output up to the band for one part of the buffer */
+static void tx_synth_part(void *arg, unsigned part, unsigned nparts)
+{
+	struct tx_job *job = arg;
+	struct synth *sy = job->tx->synth;
+	struct tx_mixer m;
+	unsigned long j1, j2;
+	unsigned k;
 
+	const unsigned long start = job->n * part / nparts;
+	const unsigned long end = job->n * (part + 1) / nparts;
+	tx_mixer_init(&m, job, start);
+	for (k = 0; k < sy->nseg; k++) {
+		struct synth_seg *seg = &sy->seg[k];
+		j1 = seg->start > start ? seg->start : start;
+		j2 = seg->start + seg->len < end ? seg->start + seg->len : end;
+		if (j1 >= j2)
+			continue;
+		tx_mix(&m, j1, j2, j1 - seg->start, seg->v, seg->dv);
+	}
+}
 
-struct transmitter {
-	double fs; // Exact sample rate
-	char initialized, wspr_on, ps; // Flags
-	int8_t *buf; // Buffer, allocated at init
+/* Compute one part of a buffer of noise: Gaussian samples for the
+ * part, polyphase interpolation and linear interpolation to fs */
+static void tx_noise_part(void *arg, unsigned part, unsigned nparts)
+{
+	struct tx_job *job = arg;
+	struct noise *ns = job->tx->noise;
+	struct tx_mixer m;
+	complex float *g = ns->g[part], *y = ns->y[part];
+	unsigned long j;
+	int64_t k, q;
 
-	uint64_t phase, freq; // Oscillator phase and frequency
-	uint64_t phs1, phs2; // Output phase shifts
-	uint64_t lcg; // Linear congruential pseudorandom generator state
+	const unsigned long start = job->n * part / nparts;
+	const unsigned long end = job->n * (part + 1) / nparts;
+	if (start >= end)
+		return;
+	/* Filtered samples q1...q2 are needed, and they are computed
+	 * from Gaussian samples k1...q2/NOISE_P */
+	const uint64_t j1 = ns->pos + start, j2 = ns->pos + end;
+	const int64_t q1 = j1 / ns->d, q2 = (j2 - 1) / ns->d + 1;
+	const int64_t k1 = q1 / NOISE_P - NOISE_T + 1, k2 = q2 / NOISE_P;
+	if ((uint64_t)(q2 - q1 + 1) > ns->nq || (uint64_t)(k2 - k1 + 1) > ns->ng) {
+		INFO("Noise part of %lu samples is too long\n", end - start);
+		return;
+	}
+	for (k = k1; k <= k2; k++)
+		g[k - k1] = noise_gauss(ns->seed, k);
+	for (q = q1; q <= q2; q++)
+		y[q - q1] = noise_filter(ns, q % NOISE_P, g + (q / NOISE_P - k1));
 
-	uint64_t wspr_symphase;
-	uint64_t wspr_freqs[MAX_FREQS], wspr_freq, wspr_step;
-	uint32_t wspr_i; // WSPR symbol index being transmitted
-	uint32_t wspr_nfreqs, wspr_freq_i;
-	const char *wspr_data;
-	int16_t sine[SINE_SIZE];
-};
+	tx_mixer_init(&m, job, start);
+	for (q = q1; q < q2; q++) {
+		uint64_t a = q * ns->d, b = a + ns->d;
+		if (a < j1)
+			a = j1;
+		if (b > j2)
+			b = j2;
+		complex float dv = (y[q - q1 + 1] - y[q - q1]) / ns->d;
+		j = a - ns->pos;
+		tx_mix(&m, j, b - ns->pos, a - q * ns->d, y[q - q1], dv);
+	}
+}
 
-uint64_t tx_hz_to_freq(struct transmitter *tx, double hz)
+/* Compute a buffer of noise */
+void tx_noise(struct transmitter *tx, int8_t *b, unsigned long n)
 {
-	return hz / (double)tx->fs * ((double)(1ULL<<63) * 2.0);
+	struct tx_job job = { .tx = tx, .b = b, .n = n, .phase = tx->phase, .lcg = tx->lcg };
+	workers_run(tx->workers, tx_noise_part, &job);
+	tx->noise->pos += n;
+	tx->phase += n * tx->freq;
+	if (tx->dither)
+		tx->lcg = tx_dither_skip(tx->dither, tx->lcg, n);
 }
 
-void tx_init(struct transmitter *tx, struct configuration *conf)
+/* Compute one part of a buffer of tones. The tones are summed in
+ * blocks, one tone at a time, so the inner loop is a plain phase
+ * accumulator and table lookup. */
+#define TONE_BLOCK 256
+static void tx_tones_part(void *arg, unsigned part, unsigned nparts)
 {
-	unsigned i;
-	for (i = 0; i < SINE_SIZE; i++)
-		tx->sine[i] = sin(6.283185307179586 * i / SINE_SIZE) * 0x7EFF;
+	struct tx_job *job = arg;
+	struct transmitter *tx = job->tx;
+	float acc[3][TONE_BLOCK];
+	uint32_t rnd[TONE_BLOCK][3];
+	unsigned long j0, i, m;
+	unsigned c, k;
 
-	tx->fs = conf->fs_exact;
-	tx->buf = malloc(FL2K_BUF_LEN * 3 * sizeof(&tx->buf));
-	tx->wspr_on = 0;
-	tx->wspr_data = conf->s;
-	tx->wspr_step = tx_hz_to_freq(tx, 12000.0 / 8192);
-	for (i = 0; i < conf->nf; i++)
-		tx->wspr_freqs[i] = tx_hz_to_freq(tx, conf->f[i]);
-	tx->wspr_nfreqs = conf->nf;
-	tx->phs1 = conf->p1 * ((double)(1ULL<<63) / 180.0);
-	tx->phs2 = conf->p2 * ((double)(1ULL<<63) / 180.0);
-	tx->ps = conf->ps;
-	tx->initialized = 1;
+	const unsigned long start = job->n * part / nparts;
+	const unsigned long end = job->n * (part + 1) / nparts;
+	const uint64_t phs[3] = { 0, tx->phs1, tx->phs2 };
+	const int16_t *sine = tx->sine;
+	const unsigned bits = tx->sine_bits;
+	const unsigned nout = tx->nout;
+	const char dither = tx->dither, poly = tx->poly;
+	const float gain = poly ? tx->tone_gain * tx->amp * 0x7EFF : tx->tone_gain;
+	uint64_t lcg = dither ? tx_dither_skip(dither, job->lcg, start) : 0;
+	for (j0 = start; j0 < end; j0 += m) {
+		m = end - j0 < TONE_BLOCK ? end - j0 : TONE_BLOCK;
+		for (i = 0; i < m; i++) {
+			rnd[i][0] = 0;
+			if (dither)
+				tx_dither_rand(dither, &lcg, rnd[i]);
+		}
+		memset(acc, 0, sizeof(acc));
+		for (k = 0; k < tx->ntones; k++) {
+			const uint64_t f = tx->tone_freq[k];
+			for (c = 0; c < nout; c++) {
+				uint64_t p = tx->tone_phase[k] + (j0 + 1) * f + phs[c];
+				float *a = acc[c];
+				for (i = 0; i < m; i++, p += f) {
+					if (poly)
+						a[i] += tx_poly_sine(p);
+					else if (tx_dither_phase(dither))
+						a[i] += sine[(p + ((uint64_t)rnd[i][0] << (32 - bits))) >> (64 - bits)];
+					else
+						a[i] += sine[p >> (64 - bits)];
+				}
+			}
+		}
+		for (c = 0; c < nout; c++) {
+			int8_t *b = job->b + FL2K_BUF_LEN*c + j0;
+			for (i = 0; i < m; i++) {
+				int32_t out = acc[c][i] * gain;
+				if (out > 0x7EFF)
+					out = 0x7EFF;
+				if (out < -0x7EFF)
+					out = -0x7EFF;
+				if (tx_dither_amp(dither))
+					out = tx_dither_clamp(out + tx_dither_value(dither, rnd[i], c));
+				b[i] = (uint16_t)(0x7F00 + out) >> 8;
+			}
+		}
+	}
+}
+
+/* Compute a buffer of tones */
+void tx_tones_render(struct transmitter *tx, int8_t *b, unsigned long n)
+{
+	struct tx_job job = { .tx = tx, .b = b, .n = n, .lcg = tx->lcg };
+	unsigned k;
+	workers_run(tx->workers, tx_tones_part, &job);
+	for (k = 0; k < tx->ntones; k++)
+		tx->tone_phase[k] += n * tx->tone_freq[k];
+	if (tx->dither)
+		tx->lcg = tx_dither_skip(tx->dither, tx->lcg, n);
+}
+
+/* Mix the synthesizer output up to the band.
+ * The baseband samples needed for the buffer are computed first,
+ * then the parts of the buffer in parallel.
+ * Returns the number of samples computed to each output,
+ * which is less than n at the end of the transmission. */
+unsigned long tx_synth(struct transmitter *tx, int8_t *b, unsigned long n)
+{
+	struct synth *sy = tx->synth;
+	struct tx_job job = { .tx = tx, .b = b, .phase = tx->phase, .lcg = tx->lcg };
+	unsigned long i = 0, m;
+
+	sy->nseg = 0;
+	while (i < n) {
+		if (sy->k == 0 && !synth_next(sy))
+			break;
+		m = n - i;
+		if (m > sy->k)
+			m = sy->k;
+		sy->seg[sy->nseg++] = (struct synth_seg){ i, m, sy->v, sy->dv };
+		sy->v += sy->dv * (float)m;
+		sy->k -= m;
+		i += m;
+	}
+	job.n = i;
+	workers_run(tx->workers, tx_synth_part, &job);
+	tx->phase += i * tx->freq;
+	if (tx->dither)
+		tx->lcg = tx_dither_skip(tx->dither, tx->lcg, i);
+	return i;
+}
+
+/* Fill one buffer. The transmission is computed in spans between
+ * symbol changes, so the inner loop only sees a constant frequency.
+ * Returns the number of samples transmitted in the buffer. */
+unsigned long tx_render(struct transmitter *tx, fl2k_data_info_t *fldata)
+{
+	int8_t *b = tx->buf;
+	unsigned long i = 0, n, lead = tx->lead;
+	unsigned c;
+
+	fldata->sampletype_signed = 0;
+	if (tx->cache) {
+		char *out[3];
+		for (c = 0; c < 3; c++)
+			out[c] = (char*)tx->out[c] + (tx->out[c] != tx->idle ? tx->cache_pos : 0);
+		fldata->r_buf = out[0];
+		fldata->g_buf = out[1];
+		fldata->b_buf = out[2];
+		tx->cache_pos = (tx->cache_pos + FL2K_BUF_LEN) & (tx->cache_period - 1);
+		return FL2K_BUF_LEN;
+	}
+	if (tx->tune) {
+		tx_kernel_run(tx, b, FL2K_BUF_LEN);
+		i = FL2K_BUF_LEN;
+	}
+	if (tx->noise) {
+		tx_noise(tx, b, FL2K_BUF_LEN);
+		i = FL2K_BUF_LEN;
+	}
+	if (tx->ntones) {
+		tx_tones_render(tx, b, FL2K_BUF_LEN);
+		i = FL2K_BUF_LEN;
+	}
+	/* A synchronized start leaves the beginning of the buffer idle */
+	if (lead > 0) {
+		tx->lead = 0;
+		i = lead;
+	}
+	if (tx->synth && tx->wspr_on) {
+		i = lead + tx_synth(tx, b + lead, FL2K_BUF_LEN - lead);
+		if (i < FL2K_BUF_LEN) {
+			tx->wspr_on = 0;
+			INFO("Stopping WSPR transmission\n");
+		}
+	}
+	while (i < FL2K_BUF_LEN && tx->wspr_on) {
+		/* Samples left until symphase wraps around */
+		uint64_t left = ~tx->wspr_symphase / tx->wspr_step + 1;
+		n = FL2K_BUF_LEN - i;
+		if (left <= n)
+			n = left;
+		tx_kernel_run(tx, b + i, n);
+		i += n;
+		tx->wspr_symphase += n * tx->wspr_step;
+		if (n == left) {
+			/* Next symbol */
+			if (++tx->wspr_i < WSPR_LEN) {
+				unsigned s = tx->wspr_data[tx->wspr_i] - '0';
+				tx->freq = tx->wspr_freq + tx->wspr_step * s;
+				/* Keeps what frequency offsets have added */
+				const uint64_t (*plan)[3] = &tx->phs_plan[tx->wspr_i - 1];
+				tx->phase += plan[1][0] - plan[0][0];
+				tx->phs1 += plan[1][1] - plan[0][1];
+				tx->phs2 += plan[1][2] - plan[0][2];
+				INFO("WSPR symbol %3u: %u\n", tx->wspr_i, s);
+			} else {
+				tx->wspr_on = 0;
+				INFO("Stopping WSPR transmission\n");
+			}
+		}
+	}
+
+	if (i == 0) {
+		/* Nothing transmitted in this buffer */
+		fldata->r_buf = fldata->g_buf = fldata->b_buf = (char*)tx->idle;
+		return 0;
+	}
+	for (c = 0; c < tx->nout; c++) {
+		memset(b + FL2K_BUF_LEN*c, 0x80, lead);
+		memset(b + FL2K_BUF_LEN*c + i, 0x80, FL2K_BUF_LEN - i);
+	}
+	if (tx->nt)
+		tx_stream_fence();
+	fldata->r_buf = (char*)tx->out[0];
+	fldata->g_buf = (char*)tx->out[1];
+	fldata->b_buf = (char*)tx->out[2];
+	return i;
+}
+
+/* Write n samples of the outputs in use to a file, interleaved */
+int tx_write(struct transmitter *tx, fl2k_data_info_t *fldata, unsigned long n, FILE *f)
+{
+	const char *out[3] = { fldata->r_buf, fldata->g_buf, fldata->b_buf };
+	static char buf[FL2K_BUF_LEN * 3];
+	unsigned long i;
+	unsigned c, nch = tx->nch;
+	if (nch == 1)
+		return fwrite(out[0], 1, n, f) == n ? 0 : -1;
+	for (i = 0; i < n; i++)
+		for (c = 0; c < nch; c++)
+			buf[i*nch + c] = out[c][i];
+	return fwrite(buf, nch, n, f) == n ? 0 : -1;
+}
+
+/* Follow the timeline of the samples from the time of a callback, and
+ * if the next slot starts in the buffer, return the number of idle
+ * samples before it, otherwise -1. The callback asks
+ * for a buffer some constant time before it is sent, which is the
+ * same for similar adapters, and what is left over is set by delay. */
+static long long tx_sync_start(struct transmitter *tx, const struct timespec *tp)
+{
+	const double len = FL2K_BUF_LEN / tx->fs;
+	const unsigned long k = tx->callbacks - 1 - tx->sync_base;
+	if (tx->sync_epoch == 0)
+		tx->sync_epoch = tp->tv_sec - tp->tv_sec % 120;
+	double off = (tp->tv_sec - tx->sync_epoch) + 1e-9 * tp->tv_nsec - k * len;
+	/* Follow the earliest callback, slowly moving later to track
+	 * the remaining error of the sample rate */
+	if (!tx->sync_valid || off < tx->sync_t0) {
+		tx->sync_t0 = off;
+		tx->sync_valid = 1;
+	} else {
+		tx->sync_t0 += (off - tx->sync_t0) * (1.0 / 256);
+	}
+	if (tx->wspr_on)
+		return -1;
+	/* Start of the buffer, moved back by the delay, and the first
+	 * slot starting after it */
+	double tb = tx->sync_t0 + k * len - floor(tx->delay) / tx->fs;
+	double slot = 120.0 * ceil((tb - 1.0) / 120.0) + 1.0;
+	long long s = llround((slot - tb) * tx->fs);
+	return s < FL2K_BUF_LEN ? s : -1;
 }
 
 void tx_callback(fl2k_data_info_t *fldata)
 {
 	struct transmitter *tx = fldata->ctx;
-	if (!tx->initialized)
-		return;
-	if (fldata->len != FL2K_BUF_LEN)
+	/* The count is published after the time it refers to */
+	const unsigned long n = tx->callbacks;
+	if (n == tx->sync_base) {
+		struct timespec tp;
+		clock_gettime(CLOCK_MONOTONIC, &tp);
+		tx->first_callback = tp;
+	}
+	__atomic_store_n(&tx->callbacks, n + 1, __ATOMIC_RELEASE);
+	if (!__atomic_load_n(&tx->initialized, __ATOMIC_ACQUIRE) || tx->stopping || fldata->len != FL2K_BUF_LEN) {
+		/* Not ready: send idle samples rather than leaving
+		 * the buffers unset */
+		if (fldata->len <= FL2K_BUF_LEN) {
+			fldata->sampletype_signed = 0;
+			fldata->r_buf = fldata->g_buf = fldata->b_buf = (char*)tx->idle;
+		}
 		return;
+	}
 
 	struct timespec tp;
 	clock_gettime(CLOCK_REALTIME, &tp);
-	if (!tx->wspr_on && (tp.tv_sec % 120) == 1) {
-		// Start WSPR transmission
-		tx->wspr_i = 0;
-		tx->wspr_symphase = 0;
-		tx->phase = 0;
-		tx->wspr_freq = tx->wspr_freqs[tx->wspr_freq_i];
-		tx->freq = tx->wspr_freq + tx->wspr_step * (tx->wspr_data[0] - '0');
-		INFO("Starting WPSR transmission on band %d\n", tx->wspr_freq_i);
-		tx->wspr_freq_i = (tx->wspr_freq_i + 1) % tx->wspr_nfreqs;
-		if (tx->ps == 1) {
-			uint64_t p = tx->phs1;
-			tx->phs1 = tx->phs2;
-			tx->phs2 = p;
-		}
-		tx->wspr_on = 1;
+	long long lead = tx->sync ? tx_sync_start(tx, &tp) :
+		!tx->wspr_on && (tp.tv_sec % 120) == 1 ? 0 : -1;
+	int start = lead >= 0;
+	/* With a duty cycle, only in the slots the scheduler chose */
+	if (start && tx->sched)
+		start = __atomic_exchange_n(&tx->armed, 0, __ATOMIC_ACQUIRE);
+	if (start) {
+		tx->lead = lead;
+		tx_start(tx);
 	}
+	tx_render(tx, fldata);
+}
 
-	int8_t *b = tx->buf;
-	long unsigned i;
+/* Render nbuf buffers and return the rate (MS/s) */
+double tx_bench_rate(struct transmitter *tx, unsigned nbuf)
+{
+	fl2k_data_info_t fldata = { .ctx = tx, .len = FL2K_BUF_LEN };
+	struct timespec t1, t2;
+	unsigned i;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < nbuf; i++)
+		tx_render(tx, &fldata);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	return 1e-6 * nbuf * FL2K_BUF_LEN /
+		((t2.tv_sec - t1.tv_sec) + 1e-9 * (t2.tv_nsec - t1.tv_nsec));
+}
 
-	/* Copy most often used struct members to local variables */
-	uint64_t tx_phase = tx->phase, tx_freq = tx->freq;
-	uint64_t wspr_symphase = tx->wspr_symphase;
-	uint64_t lcg = tx->lcg;
-	char wspr_on = tx->wspr_on;
-	const uint64_t wspr_step = tx->wspr_step;
-	const uint64_t phs1 = tx->phs1;
-	const uint64_t phs2 = tx->phs2;
-	for (i = 0; i < FL2K_BUF_LEN; i++) {
-		/* Pseudorandom generator for dithering, parameters from
-		 * https://en.wikipedia.org/wiki/Linear_congruential_generator#Parameters_in_common_use */
-		lcg = lcg * 6364136223846793005ULL + 1;
-		uint32_t rnd = lcg >> 32;
-		if (wspr_on) {
-			tx_phase += tx_freq;
-			/* Add phase dithering before truncation
-			 * to sine table size */
-			uint64_t ph = tx_phase + (rnd << (64-32-SINE_SHIFT));
-			/* Outputs with different phase shifts */
-			int16_t out0, out1, out2;
-			out0 = tx->sine[ ph         >> (64-SINE_SHIFT)];
-			out1 = tx->sine[(ph + phs1) >> (64-SINE_SHIFT)];
-			out2 = tx->sine[(ph + phs2) >> (64-SINE_SHIFT)];
-			/* Add dithering to output values.
-			 * Use different bits of the RNG for each channel. */
-			out0 += 0xFF & rnd;
-			out1 += 0xFF & rnd >> 8;
-			out2 += 0xFF & rnd >> 16;
-			/* Quantization to 8 bits */
-			b[0]              = (uint16_t)(0x7F00 + out0) >> 8;
-			b[FL2K_BUF_LEN]   = (uint16_t)(0x7F00 + out1) >> 8;
-			b[FL2K_BUF_LEN*2] = (uint16_t)(0x7F00 + out2) >> 8;
-			b++;
-			/* Next symbol when symphase wraps around */
-			uint64_t sp = wspr_symphase;
-			if ((wspr_symphase = sp + wspr_step) < sp) {
-				if (++tx->wspr_i < WSPR_LEN) {
-					unsigned s = tx->wspr_data[tx->wspr_i] - '0';
-					tx_freq = tx->wspr_freq + tx->wspr_step * s;
-					INFO("WSPR symbol %3u: %u\n", tx->wspr_i, s);
-				} else {
-					wspr_on = 0;
-					INFO("Stopping WSPR transmission\n");
-				}
+/* Measure the throughput of one inner loop variant */
+static double tx_bench_kernel(struct transmitter *tx, unsigned nbuf,
+	int nch, int shift, int dither, int mode)
+{
+	tx->nch = nch;
+	tx->share = 0;
+	tx_start(tx);
+	tx->kernel = tx_kernels[mode][dither][shift][nch-1];
+	double rate = tx_bench_rate(tx, nbuf);
+	tx->wspr_on = 0;
+	return rate;
+}
+
+/* Power of the error of the sine before quantization and dithering
+ * relative to the carrier (dB), which bounds the level of the spurs
+ * it causes. The phases are spread evenly by a golden ratio step. */
+static double tx_sine_error(struct transmitter *tx, int mode)
+{
+	const unsigned long n = 1UL << 18;
+	const double a = tx->amp * 0x7EFF;
+	double e = 0;
+	unsigned long i;
+	for (i = 0; i < n; i++) {
+		uint64_t ph = i * 0x9E3779B97F4A7C15ULL;
+		double v = mode == SINE_POLY ? (int16_t)(a * tx_poly_sine(ph)) :
+			mode == SINE_INTERP ? tx_interp_sine(tx->isine, ph >> 32, tx->sine_bits - 2) :
+			mode == SINE_QUARTER ? tx_quarter_sine(tx->qsine, ph, tx->sine_bits) :
+			tx->sine[ph >> (64 - tx->sine_bits)];
+		/* Truncating the phase delays it by half a table step
+		 * on average, which is no spur */
+		if (mode == SINE_TABLE || mode == SINE_QUARTER)
+			ph -= 1ULL << (63 - tx->sine_bits);
+		v -= a * sin(ph * (6.283185307179586 / 18446744073709551616.0));
+		e += v * v;
+	}
+	return 10 * log10(e / n / (a * a / 2));
+}
+
+/* In-place FFT for the spur measurement */
+static void bench_fft(complex double *x, unsigned long n)
+{
+	unsigned long i, j, len;
+	for (i = 1, j = 0; i < n; i++) {
+		unsigned long bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			complex double t = x[i];
+			x[i] = x[j];
+			x[j] = t;
+		}
+	}
+	for (len = 2; len <= n; len <<= 1) {
+		const complex double wl = cexp(-6.283185307179586 * I / len);
+		for (i = 0; i < n; i += len) {
+			complex double w = 1;
+			for (j = 0; j < len / 2; j++, w *= wl) {
+				complex double a = x[i + j], b = x[i + j + len / 2] * w;
+				x[i + j] = a + b;
+				x[i + j + len / 2] = a - b;
 			}
-		} else {
-			b[0]              =
-			b[FL2K_BUF_LEN]   =
-			b[FL2K_BUF_LEN*2] = 0x80;
-			b++;
 		}
 	}
-	tx->phase = tx_phase;
-	tx->freq = tx_freq;
-	tx->lcg = lcg;
-	tx->wspr_symphase = wspr_symphase;
-	tx->wspr_on = wspr_on;
+}
 
-	fldata->sampletype_signed = 0;
-	fldata->r_buf = (char*)tx->buf;
-	fldata->g_buf = (char*)tx->buf + FL2K_BUF_LEN;
-	fldata->b_buf = (char*)tx->buf + FL2K_BUF_LEN*2;
+/* Worst spur (dBc) and noise density around the carrier (dBc/Hz) in
+ * the first output of an inner loop variant, from an FFT of a block
+ * of samples with a Blackman-Harris window. Spurs are compared by the
+ * peak bin, noise by the mean of the bins within 1/16 of fs of the
+ * carrier, so that shaped dither gets credit for moving noise away. */
+#define SPUR_N 65536
+static void tx_bench_spurs(struct transmitter *tx, int dither, int mode,
+	double *spur, double *noise)
+{
+	static complex double x[SPUR_N];
+	unsigned long i, k, kc = 1, nn = 0;
+	double pmax = 0, pn = 0;
+	tx->nch = 1;
+	tx->share = 0;
+	tx_start(tx);
+	tx->kernel = tx_kernels[mode][dither][0][0];
+	tx->kernel(tx, tx->buf, SPUR_N);
+	tx->wspr_on = 0;
+	for (i = 0; i < SPUR_N; i++) {
+		double a = 6.283185307179586 * i / SPUR_N;
+		double w = 0.35875 - 0.48829 * cos(a) + 0.14128 * cos(2 * a) - 0.01168 * cos(3 * a);
+		x[i] = ((uint8_t)tx->buf[i] - 127.5) * w;
+	}
+	bench_fft(x, SPUR_N);
+	for (k = 1; k < SPUR_N / 2; k++)
+		if (cabs(x[k]) > cabs(x[kc]))
+			kc = k;
+	const double pc = creal(x[kc] * conj(x[kc]));
+	/* Past the main lobe of the window and away from DC */
+	for (k = 16; k < SPUR_N / 2; k++) {
+		const double p = creal(x[k] * conj(x[k]));
+		const unsigned long d = k > kc ? k - kc : kc - k;
+		if (d < 8)
+			continue;
+		if (p > pmax)
+			pmax = p;
+		if (d < SPUR_N / 16) {
+			pn += p;
+			nn++;
+		}
+	}
+	/* Relative to the peak of the carrier, a bin of noise is the
+	 * density times fs/n times the equivalent noise bandwidth of
+	 * the window in bins */
+	*spur = 10 * log10(pmax / pc);
+	*noise = 10 * log10(pn / nn / pc * SPUR_N / (2.0044 * tx->fs));
+}
+
+/* Measure the throughput of each inner loop variant */
+void tx_bench(struct transmitter *tx, unsigned nbuf)
+{
+	static const char *const modes[SINE_MODES] = { "table", "poly", "quarter", "interp" };
+	int mode, dither, shift, nch, nt;
+	unsigned bits, sine_bits = tx->sine_bits;
+	char quarter = tx->quarter, interp = tx->interp;
+	double ref = 0;
+
+	if (tx->synth) {
+		tx_start(tx);
+		printf("%u signals: %.1f MS/s\n", tx->synth->nsig, tx_bench_rate(tx, nbuf));
+		tx->wspr_on = 0;
+		return;
+	}
+	if (tx->comb) {
+		tx_start(tx);
+		printf("Combined DAC: %.1f MS/s\n", tx_bench_rate(tx, nbuf));
+		tx->wspr_on = 0;
+		return;
+	}
+	if (tx->noise) {
+		printf("Noise: %.1f MS/s\n", tx_bench_rate(tx, nbuf));
+		return;
+	}
+	if (tx->ntones) {
+		printf("%u tones: %.1f MS/s\n", tx->ntones, tx_bench_rate(tx, nbuf));
+		return;
+	}
+	/* The rows below time the loops, so the buffers must not come
+	 * from a cached carrier, and tune may not have symbols for them */
+	if (tx->cache) {
+		unsigned c;
+		INFO("Not using the cached carrier for the benchmark\n");
+		for (c = 0; c < 3; c++)
+			if (tx->out[c] != tx->idle)
+				tx->out[c] = tx->buf + (tx->out[c] - tx->cache) / tx->cache_len * FL2K_BUF_LEN;
+		free(tx->cache);
+		tx->cache = NULL;
+	}
+	if (strlen(tx->wspr_data) != WSPR_LEN) {
+		static char zeros[WSPR_LEN + 1];
+		memset(zeros, '0', WSPR_LEN);
+		tx->wspr_data = zeros;
+	}
+#ifdef TX_VEC
+	printf("Polynomial loops vectorized: %s, %d samples per vector\n", TX_VEC_ISA, TX_VEC_N);
+#else
+	printf("Polynomial loops vectorized: %s\n", TX_VEC_ISA);
+#endif
+	/* The quarter wave and interpolating loops need their tables too */
+	tx_alloc_sine(tx, sine_bits, 1, 1);
+	printf("ch shift dither mode       MS/s  relative\n");
+	for (mode = 0; mode < SINE_MODES; mode++)
+	for (dither = 1; dither >= 0; dither--)
+	for (shift = 1; shift >= 0; shift--)
+	for (nch = 3; nch >= 1; nch--) {
+		if (nch == 1 && shift)
+			continue;
+		double rate = tx_bench_kernel(tx, nbuf, nch, shift, dither, mode);
+		/* Compare to the full 3-output table lookup loop */
+		if (ref == 0)
+			ref = rate;
+		printf("%2d %5d %6d %-7s %7.1f %9.2f\n",
+			nch, shift, dither, modes[mode], rate, rate / ref);
+	}
+
+	/* Larger tables lower the spurs until they no longer fit in L1,
+	 * a quarter wave fits four times as many entries. Interpolation
+	 * gets far lower spurs from the same table, compare it with the
+	 * 1024 entry table used before the size was selectable. */
+	printf("Sine table size, 3 outputs with shifts and dither:\n");
+	printf("bits  error dBc: table  interp   MS/s: table  quarter  interp\n");
+	for (bits = SINE_BITS_MIN; bits <= SINE_BITS_MAX; bits++) {
+		tx_alloc_sine(tx, bits, 1, 1);
+		double table = tx_bench_kernel(tx, nbuf, 3, 1, 1, SINE_TABLE);
+		double qtable = tx_bench_kernel(tx, nbuf, 3, 1, 1, SINE_QUARTER);
+		double irate = tx_bench_kernel(tx, nbuf, 3, 1, 1, SINE_INTERP);
+		printf("%4u %16.1f %7.1f %12.1f %8.1f %7.1f\n", bits,
+			tx_sine_error(tx, SINE_TABLE), tx_sine_error(tx, SINE_INTERP),
+			table, qtable, irate);
+	}
+	printf("Polynomial error: %.1f dBc\n", tx_sine_error(tx, SINE_POLY));
+	tx_alloc_sine(tx, sine_bits, quarter, interp);
+
+	/* Phase dither only matters for the table loops, and the dither
+	 * noise is traded against the spurs it removes */
+	printf("Dither types, 3 outputs with shifts. Spurs and noise of one output:\n");
+	printf("dither  table MS/s  spur dBc  noise dBc/Hz   poly MS/s  spur dBc  noise dBc/Hz\n");
+	for (dither = 0; dither < DITHER_TYPES; dither++) {
+		double tspur, tnoise, pspur, pnoise;
+		double table = tx_bench_kernel(tx, nbuf, 3, 1, dither, SINE_TABLE);
+		double poly = tx_bench_kernel(tx, nbuf, 3, 1, dither, SINE_POLY);
+		tx_bench_spurs(tx, dither, SINE_TABLE, &tspur, &tnoise);
+		tx_bench_spurs(tx, dither, SINE_POLY, &pspur, &pnoise);
+		printf("%-6s %11.1f %9.1f %13.1f %11.1f %9.1f %13.1f\n", dither_names[dither],
+			table, tspur, tnoise, poly, pspur, pnoise);
+	}
+
+	/* The table loop needs the sine table in the cache, so it gains
+	 * more from stores that do not evict it than the polynomial one */
+	printf("Non-temporal stores, 3 outputs with shifts and dither:\n");
+	printf("nt  table MS/s  poly MS/s\n");
+	for (nt = 0; nt <= 1; nt++) {
+		tx_set_nt(tx, nt);
+		double table = tx_bench_kernel(tx, nbuf, 3, 1, 1, SINE_TABLE);
+		printf("%2d %11.1f %10.1f\n", nt, table, tx_bench_kernel(tx, nbuf, 3, 1, 1, SINE_POLY));
+	}
+
+	/* Whether the table stays in the cache while the buffers are
+	 * written: the table loop with and without non-temporal stores
+	 * as the table grows past L1 and L2, up to the first one larger
+	 * than twice L2 */
+	const long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE), l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	printf("Full sine table in the cache, 3 outputs with shifts and dither:\n");
+	printf("bits    bytes  fits in  nt 0 MS/s  nt 1 MS/s\n");
+	for (bits = SINE_BITS_MIN; bits <= 24; bits++) {
+		const long bytes = 2L << bits;
+		double rate[2];
+		tx_alloc_sine(tx, bits, 0, 0);
+		for (nt = 0; nt <= 1; nt++) {
+			tx_set_nt(tx, nt);
+			rate[nt] = tx_bench_kernel(tx, nbuf, 3, 1, 1, SINE_TABLE);
+		}
+		printf("%4u %8ld  %-7s %10.1f %10.1f\n", bits, bytes,
+			l1 > 0 && bytes <= l1 ? "L1" : l2 > 0 && bytes <= l2 ? "L2" :
+			l1 > 0 && l2 > 0 ? "memory" : "?", rate[0], rate[1]);
+		if (bytes > 2 * (l2 > 0 ? l2 : 1L << 20))
+			break;
+	}
+	tx_alloc_sine(tx, sine_bits, quarter, interp);
+}
+
+/* Find where a transmission starts on one channel of a capture and its
+ * carrier phase after that. The carrier at fa is mixed down and its
+ * envelope averaged over w samples, and the start is where the
+ * envelope first crosses half of its peak, interpolated between
+ * samples. The averaging delays all channels equally. */
+static double sync_onset(const int16_t *x, unsigned long n, double fa, unsigned long w)
+{
+	complex double *z = malloc(n * sizeof(*z)), acc = 0;
+	double *e = malloc(n * sizeof(*e)), peak = 0, t = -1;
+	unsigned long i;
+	for (i = 0; i < n; i++) {
+		z[i] = x[2*i] * cexp(-2.0 * I * M_PI * fa * i);
+		acc += z[i] - (i >= w ? z[i - w] : 0);
+		e[i] = cabs(acc);
+		if (e[i] > peak)
+			peak = e[i];
+	}
+	for (i = 0; i < n; i++) {
+		if (e[i] >= 0.5 * peak) {
+			t = i == 0 ? 0 : i - (e[i] - 0.5 * peak) / (e[i] - e[i - 1]);
+			break;
+		}
+	}
+	free(z);
+	free(e);
+	return t;
+}
+
+static double sync_phase(const int16_t *x, unsigned long start, unsigned long n, double fa)
+{
+	complex double acc = 0;
+	unsigned long i;
+	for (i = start; i < n; i++)
+		acc += x[2*i] * cexp(-2.0 * I * M_PI * fa * i);
+	return carg(acc);
+}
+
+/* Measure delay and dphase for sync from a loopback capture of a
+ * transmission, sampled directly at capfs with the reference adapter
+ * on the first channel and the adapter to calibrate on the second.
+ * The carrier may be an alias of f, which is inverted when it is
+ * above capfs/2. */
+void sync_cal(struct configuration *conf)
+{
+	const double fs = (1.0 + 1e-6 * conf->ppm) * conf->fs, f = conf->f[0];
+	double fa = fmod(f, conf->capfs) / conf->capfs, sign = 1;
+	int16_t *x = NULL;
+	unsigned long n = 0, size = 0, m;
+	FILE *fp = fopen(conf->synccal, "rb");
+	if (fp == NULL) {
+		INFO("Opening %s failed\n", conf->synccal);
+		return;
+	}
+	do {
+		if (n == size) {
+			size = size ? 2 * size : 1UL << 20;
+			x = realloc(x, size * 2 * sizeof(*x));
+		}
+		m = fread(x + 2*n, 2 * sizeof(*x), size - n, fp);
+		n += m;
+	} while (m > 0);
+	fclose(fp);
+	if (fa > 0.5) {
+		fa = 1.0 - fa;
+		sign = -1;
+	}
+	if (fa < 1e-3 || fa > 0.499) {
+		INFO("The carrier is too close to DC or capfs/2 in the capture\n");
+		free(x);
+		return;
+	}
+	/* Average over a few periods of the carrier */
+	unsigned long w = (unsigned long)ceil(4.0 / fa);
+	double t0 = sync_onset(x, n, fa, w), t1 = sync_onset(x + 1, n, fa, w);
+	if (t0 < 0 || t1 < 0 || n < (unsigned long)fmax(t0, t1) + 2*w) {
+		INFO("No transmission found in the capture\n");
+		free(x);
+		return;
+	}
+	/* Phases from the carrier after both have started */
+	unsigned long start = (unsigned long)fmax(t0, t1) + 2*w;
+	double p0 = sign * sync_phase(x, start, n, fa), p1 = sign * sync_phase(x + 1, start, n, fa);
+	/* The second adapter is early by t0 - t1. Delaying it by d samples
+	 * also turns the carrier back by 360 f d / fs degrees. */
+	double d = (t0 - t1) / conf->capfs * fs;
+	double ph = (p0 - p1) * (180.0 / M_PI) + 360.0 * f * d / fs;
+	ph -= 360.0 * floor(ph / 360.0);
+	INFO("Capture of %.3f s, starts at %.9f s and %.9f s\n",
+		n / conf->capfs, t0 / conf->capfs, t1 / conf->capfs);
+	printf("delay %.2f dphase %.1f\n", d, ph);
+	free(x);
+}
+
+/* Duty cycle scheduler. Slots go through the bands in turn, so the
+ * band of a slot only depends on its number. A slot is chosen with a
+ * probability that gives the duty of its band when the previous slot
+ * cannot be a transmission too, or the duty itself if that would
+ * need more than every other slot. */
+struct sched {
+	double p[MAX_FREQS]; // Duty of each band
+	unsigned nbands;
+	uint64_t rng;
+	long long last, decided; // Last slot transmitted and last one decided
+	unsigned long slots[MAX_FREQS], chosen[MAX_FREQS];
+};
+
+void sched_init(struct sched *sc, struct configuration *conf, uint64_t seed)
+{
+	unsigned i;
+	memset(sc, 0, sizeof(*sc));
+	sc->nbands = conf->nf;
+	for (i = 0; i < conf->nf; i++)
+		sc->p[i] = 0.01 * conf->duty[i < conf->nduty ? i : conf->nduty - 1];
+	sc->rng = seed;
+	sc->last = sc->decided = -2;
+}
+
+/* Decide a slot. Returns the band to transmit on, or -1 to stay idle. */
+int sched_slot(struct sched *sc, long long slot)
+{
+	const unsigned band = slot % sc->nbands, prev = (slot + sc->nbands - 1) % sc->nbands;
+	const double p = sc->p[band], pp = sc->p[prev];
+	double q = p;
+	sc->decided = slot;
+	sc->slots[band]++;
+	/* Spacing the transmissions leaves only strict alternation when
+	 * the duties add to 1, and with bands in turn that would always
+	 * be the same band, so the slots are then drawn independently */
+	if (p + pp < 1.0) {
+		if (sc->last == slot - 1)
+			return -1;
+		q = p / (1.0 - pp);
+	}
+	if (synth_random(&sc->rng) >= q)
+		return -1;
+	sc->last = slot;
+	sc->chosen[band]++;
+	return band;
+}
+
+/* Print the duty cycle achieved on each band from the transmissions
+ * actually started */
+void sched_stats(struct sched *sc, struct transmitter *tx)
+{
+	unsigned long slots = 0, sent = 0;
+	unsigned i;
+	for (i = 0; i < sc->nbands; i++) {
+		INFO("Band %u: %lu of %lu slots, %.1f %% (%.1f %% wanted)\n", i, tx->sent[i],
+			sc->slots[i], sc->slots[i] ? 100.0 * tx->sent[i] / sc->slots[i] : 0.0,
+			100.0 * sc->p[i]);
+		slots += sc->slots[i];
+		sent += tx->sent[i];
+	}
+	INFO("Transmitted in %lu of %lu slots, %.1f %%\n", sent, slots,
+		slots ? 100.0 * sent / slots : 0.0);
 }
 
 volatile char running = 1;
@@ -212,6 +3034,312 @@ void sighandler(int sig)
 	running = 0;
 }
 
+/* Write n idle samples to a file */
+static int tx_write_idle(struct transmitter *tx, uint64_t n, FILE *f)
+{
+	fl2k_data_info_t fldata = { .ctx = tx, .len = FL2K_BUF_LEN };
+	fldata.r_buf = fldata.g_buf = fldata.b_buf = (char*)tx->idle;
+	while (n > 0) {
+		unsigned long m = n < FL2K_BUF_LEN ? n : FL2K_BUF_LEN;
+		if (tx_write(tx, &fldata, m, f) < 0)
+			return -1;
+		n -= m;
+	}
+	return 0;
+}
+
+/* Compute transmissions to a file as fast as possible.
+ * With slots = 0, write one transmission, or continuous signals until
+ * interrupted. Otherwise, write the given number of whole 2-minute
+ * slots as they would be sent, each one second of idle, the
+ * transmission and idle until the end of the slot, or only idle in
+ * the slots the scheduler sc, if given, does not choose. */
+int tx_file(struct transmitter *tx, FILE *f, unsigned slots, struct sched *sc)
+{
+	fl2k_data_info_t fldata = { .ctx = tx, .len = FL2K_BUF_LEN };
+	const uint64_t slot_len = llround(120.0 * tx->fs);
+	const char continuous = tx->tune || tx->noise || tx->ntones;
+	uint64_t total = 0, end = slots * slot_len, n;
+	struct timespec t1, t2;
+	unsigned slot;
+	int r = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (slot = 0; slot < (slots ? slots : 1) && running; slot++) {
+		uint64_t pos = 0;
+		if (sc && slots && !continuous) {
+			int band = sched_slot(sc, slot);
+			if (band < 0) {
+				if (tx_write_idle(tx, slot_len, f) < 0) {
+					r = -1;
+					goto end;
+				}
+				total += slot_len;
+				continue;
+			}
+			tx->wspr_freq_i = band;
+		}
+		if (slots && !continuous) {
+			pos = llround(tx->fs);
+			if (tx_write_idle(tx, pos, f) < 0) {
+				r = -1;
+				goto end;
+			}
+			total += pos;
+		}
+		if (!continuous)
+			tx_start(tx);
+		while (running && tx->wspr_on) {
+			n = tx_render(tx, &fldata);
+			if (slots && continuous && total + n >= end) {
+				n = end - total;
+				tx->wspr_on = 0;
+			}
+			if (tx_write(tx, &fldata, n, f) < 0) {
+				r = -1;
+				goto end;
+			}
+			pos += n;
+			total += n;
+		}
+		if (slots && !continuous) {
+			if (tx_write_idle(tx, slot_len - pos, f) < 0) {
+				r = -1;
+				goto end;
+			}
+			total += slot_len - pos;
+		}
+	}
+end:
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	double t = (t2.tv_sec - t1.tv_sec) + 1e-9 * (t2.tv_nsec - t1.tv_nsec);
+	INFO("Rendered %.1f s of signal in %.1f s, %.2f times real time\n",
+		total / tx->fs, t, total / tx->fs / t);
+	return r;
+}
+
+/* Set the FL2K sample rate for the next band */
+static int tx_set_rate(struct transmitter *tx, struct configuration *conf, fl2k_dev_t *fl)
+{
+	double next = tx->wspr_fs[tx->wspr_freq_i];
+	if (fl2k_set_sample_rate(fl, (uint32_t)next) < 0) {
+		INFO("Setting FL2K sample rate failed\n");
+		return -1;
+	}
+	if (next != tx->fs_nominal) {
+		uint32_t fs_r = fl2k_get_sample_rate(fl);
+		tx_set_fs(tx, next, (1.0 + 1e-6 * conf->ppm) * fs_r);
+		INFO("Switched sample rate to %lu, corrected: %.1f\n",
+			(long unsigned)fs_r, tx->fs);
+	}
+	return 0;
+}
+
+/* Start streaming again ahead of a transmission, at the time stored
+ * in t. The callback takes the time of its first call after it, so the
+ * event loop can tell how long starting took. Returns 0, or -1 if
+ * starting failed. */
+static int tx_restart(struct transmitter *tx, struct configuration *conf, fl2k_dev_t *fl,
+	struct timespec *t)
+{
+	clock_gettime(CLOCK_MONOTONIC, t);
+	/* The samples start a new timeline */
+	tx->sync_base = __atomic_load_n(&tx->callbacks, __ATOMIC_ACQUIRE);
+	tx->sync_valid = 0;
+	if (fl2k_start_tx(fl, tx_callback, tx, 2) < 0) {
+		INFO("Restarting FL2K transmission failed\n");
+		return -1;
+	}
+	tx->streaming = 1;
+	/* As in main, the sample rate can only be set after starting */
+	tx_set_rate(tx, conf, fl);
+	return 0;
+}
+
+/* Event loop of the main thread, which does all the housekeeping
+ * that is not in the callback. Signals come through a signalfd, so
+ * they have to be blocked in every thread, before any is started. */
+struct tx_loop {
+	int ep; // epoll
+	int sig; // SIGINT, SIGTERM and SIGHUP stop, SIGUSR1 prints the status
+	int tick; // Every second, 10 ms after it starts
+	int wake; // Restart of streaming, when set
+};
+
+static void tx_loop_signals(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGHUP);
+	sigaddset(set, SIGUSR1);
+}
+
+int tx_loop_init(struct tx_loop *l)
+{
+	struct itimerspec its = { { 1, 0 }, { 0, 0 } };
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct timespec tp;
+	sigset_t set;
+	int i, fds[3];
+	tx_loop_signals(&set);
+	l->ep = epoll_create1(EPOLL_CLOEXEC);
+	l->sig = signalfd(-1, &set, SFD_CLOEXEC);
+	l->tick = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+	l->wake = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+	if (l->ep < 0 || l->sig < 0 || l->tick < 0 || l->wake < 0)
+		return -1;
+	clock_gettime(CLOCK_REALTIME, &tp);
+	its.it_value.tv_sec = tp.tv_sec + 1;
+	its.it_value.tv_nsec = 10000000;
+	if (timerfd_settime(l->tick, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return -1;
+	fds[0] = l->sig;
+	fds[1] = l->tick;
+	fds[2] = l->wake;
+	for (i = 0; i < 3; i++) {
+		ev.data.fd = fds[i];
+		if (epoll_ctl(l->ep, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+void tx_loop_close(struct tx_loop *l)
+{
+	close(l->wake);
+	close(l->tick);
+	close(l->sig);
+	close(l->ep);
+}
+
+/* Wake up at the given realtime, or never with t = 0 */
+static void tx_loop_wake(struct tx_loop *l, double t)
+{
+	struct itimerspec its = { { 0, 0 }, { (time_t)t, (long)((t - floor(t)) * 1e9) } };
+	timerfd_settime(l->wake, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Print the state of the transmitter and of the scheduler */
+void tx_status(struct transmitter *tx, struct sched *sc)
+{
+	unsigned i;
+	INFO("%lu callbacks, %s, %s\n", tx->callbacks,
+		tx->streaming ? "streaming" : "not streaming",
+		tx->wspr_on ? "transmitting" : "idle");
+	if (tx->wspr_on && !tx->tune && !tx->noise && !tx->ntones)
+		INFO("Symbol %u of %u\n", tx->wspr_i, WSPR_LEN);
+	if (sc)
+		sched_stats(sc, tx);
+	else
+		for (i = 0; i < tx->wspr_nfreqs; i++)
+			INFO("Band %u: %lu transmissions\n", i, tx->sent[i]);
+}
+
+/* Wait for events for at most timeout ms (-1 for ever) and handle the
+ * signals. Returns the number of timer events. */
+int tx_loop_poll(struct tx_loop *l, struct transmitter *tx, struct sched *sc, int timeout)
+{
+	struct epoll_event ev[3];
+	int i, n, timers = 0;
+	n = epoll_wait(l->ep, ev, 3, timeout);
+	for (i = 0; i < n; i++) {
+		if (ev[i].data.fd == l->sig) {
+			struct signalfd_siginfo si;
+			if (read(l->sig, &si, sizeof(si)) != sizeof(si))
+				continue;
+			if (si.ssi_signo == SIGUSR1) {
+				tx_status(tx, sc);
+			} else {
+				INFO("Got signal %u\n", si.ssi_signo);
+				running = 0;
+			}
+		} else {
+			uint64_t exp;
+			if (read(ev[i].data.fd, &exp, sizeof(exp)) == sizeof(exp))
+				timers++;
+		}
+	}
+	return timers;
+}
+
+/* Stop sending samples and let the buffer being rendered and the one
+ * queued after it go out before streaming is stopped */
+void tx_drain(struct transmitter *tx)
+{
+	struct timespec d = { 0, 1000000 };
+	unsigned long n = tx->callbacks;
+	int i;
+	tx->stopping = 1;
+	for (i = 0; i < 1000 && tx->callbacks < n + 2; i++)
+		nanosleep(&d, NULL);
+}
+
+/* Housekeeping of the main thread while transmitting, on every tick.
+ * Switches the sample rate before a transmission on another band, and
+ * with conf->stop, stops streaming after each transmission and starts
+ * it again ahead of the next slot, woken up by its own timer. The lead
+ * time for starting is twice the longest time measured so far from
+ * starting to the first callback, plus a margin; the loop picks that
+ * time up on the next tick rather than waiting for it. With a scheduler,
+ * each slot is decided SCHED_AHEAD seconds before it starts, which
+ * sets the band for the sample rate and arms the callback, and
+ * streaming is only restarted for the slots chosen. */
+#define SCHED_AHEAD 30.0
+void tx_run(struct transmitter *tx, struct configuration *conf, fl2k_dev_t *fl,
+	struct sched *sc, struct tx_loop *l)
+{
+	double lead = 1.0, startup = 0;
+	struct timespec tp, restarted;
+	char measuring = 0;
+	while (running) {
+		if (tx_loop_poll(l, tx, sc, -1) == 0 || !running)
+			continue;
+		/* The first callback after a restart sets the lead time */
+		if (measuring && __atomic_load_n(&tx->callbacks, __ATOMIC_ACQUIRE) != tx->sync_base) {
+			double t = (tx->first_callback.tv_sec - restarted.tv_sec) +
+				1e-9 * (tx->first_callback.tv_nsec - restarted.tv_nsec);
+			INFO("Restarted streaming, first callback after %.3f s\n", t);
+			if (t > startup)
+				startup = t;
+			lead = 2.0 * startup + 0.1;
+			measuring = 0;
+		}
+		clock_gettime(CLOCK_REALTIME, &tp);
+		double now = tp.tv_sec + 1e-9 * tp.tv_nsec;
+		/* Time until the next transmission may start */
+		double until = 120.0 * floor((now - 1.0) / 120.0) + 121.0 - now;
+
+		long long next = (long long)floor((now - 1.0) / 120.0) + 1;
+		if (sc && until < SCHED_AHEAD && sc->decided != next) {
+			int band = sched_slot(sc, next);
+			if (band >= 0)
+				tx->wspr_freq_i = band;
+			/* The callback reads the band once it sees armed */
+			__atomic_store_n(&tx->armed, band >= 0, __ATOMIC_RELEASE);
+			INFO("Slot %lld on band %u: %s\n", next, (unsigned)(next % sc->nbands),
+				band >= 0 ? "transmitting" : "idle");
+		}
+
+		if (tx->streaming && !tx->wspr_on && conf->bandfs && (tp.tv_sec % 120) == 0 &&
+				tx->wspr_fs[tx->wspr_freq_i] != tx->fs_nominal)
+			tx_set_rate(tx, conf, fl);
+		if (conf->stop && tx->streaming && !tx->wspr_on && until > lead + 1.0 && until < 118.0) {
+			fl2k_stop_tx(fl);
+			tx->streaming = 0;
+			INFO("Stopped streaming, restarting %.3f s before the next slot\n", lead);
+		}
+		if (!tx->streaming && (sc == NULL || __atomic_load_n(&tx->armed, __ATOMIC_RELAXED))) {
+			/* The wake timer fires right at the lead time */
+			if (until <= lead + 1e-3) {
+				measuring = tx_restart(tx, conf, fl, &restarted) == 0;
+				tx_loop_wake(l, 0);
+			} else {
+				tx_loop_wake(l, now + until - lead);
+			}
+		}
+	}
+}
 
 int main(int argc, char *argv[])
 {
@@ -223,13 +3351,58 @@ int main(int argc, char *argv[])
 		.s = "",
 		.p1 = 0,
 		.p2 = 0,
-		.ps = 0
+		.ps = 0,
+		.eq = 0,
+		.ch = 3,
+		.dither = 1,
+		.poly = 0,
+		.sinebits = 0,
+		.quarter = 0,
+		.interp = 0,
+		.combine = 0,
+		.cwg = 64,
+		.cwb = 4096,
+		.cal = NULL,
+		.df1 = 0,
+		.df2 = 0,
+		.pstep1 = 0,
+		.pstep2 = 0,
+		.pfile = NULL,
+		.sync = 0,
+		.delay = 0,
+		.dphase = 0,
+		.steer = NULL,
+		.nm = 0,
+		.rotate = 0,
+		.nduty = 0,
+		.steerdev = -1,
+		.synccal = NULL,
+		.capfs = 0,
+		.share = 0,
+		.tune = 0,
+		.snap = 0,
+		.ns = 0,
+		.sim = 0,
+		.seed = 1,
+		.threads = 1,
+		.out = NULL,
+		.noise = 0,
+		.nlevel = -15.0,
+		.tones = 0,
+		.spacing = 1000.0,
+		.slots = 0,
+		.bandfs = 0,
+		.stop = 0,
+		.nt = 0,
+		.bench = 0
 	};
 	struct transmitter tx1 = {
 		.initialized = 0
 	};
 	struct configuration *conf = &conf1;
 	struct transmitter *tx = &tx1;
+	struct sched sc;
+	struct tx_loop loop = { -1, -1, -1, -1 };
 	fl2k_dev_t *fl = NULL;
 	int i;
 
@@ -249,8 +3422,103 @@ int main(int argc, char *argv[])
 			conf->p2 = atof(v);
 		else if (strcmp(p, "ps") == 0)
 			conf->ps = atoi(v);
+		else if (strcmp(p, "df1") == 0)
+			conf->df1 = atof(v);
+		else if (strcmp(p, "df2") == 0)
+			conf->df2 = atof(v);
+		else if (strcmp(p, "pstep1") == 0)
+			conf->pstep1 = atof(v);
+		else if (strcmp(p, "pstep2") == 0)
+			conf->pstep2 = atof(v);
+		else if (strcmp(p, "pfile") == 0)
+			conf->pfile = v;
+		else if (strcmp(p, "sync") == 0)
+			conf->sync = atoi(v);
+		else if (strcmp(p, "delay") == 0)
+			conf->delay = atof(v);
+		else if (strcmp(p, "dphase") == 0)
+			conf->dphase = atof(v);
+		else if (strcmp(p, "steer") == 0)
+			conf->steer = v;
+		else if (strcmp(p, "steerdev") == 0)
+			conf->steerdev = atoi(v);
+		else if (strcmp(p, "synccal") == 0)
+			conf->synccal = v;
+		else if (strcmp(p, "capfs") == 0)
+			conf->capfs = atof(v);
+		else if (strcmp(p, "eq") == 0)
+			conf->eq = atoi(v);
+		else if (strcmp(p, "bandfs") == 0)
+			conf->bandfs = atoi(v);
+		else if (strcmp(p, "stop") == 0)
+			conf->stop = atoi(v);
+		else if (strcmp(p, "nt") == 0)
+			conf->nt = atoi(v);
+		else if (strcmp(p, "ch") == 0)
+			conf->ch = atoi(v);
+		else if (strcmp(p, "dither") == 0) {
+			int d;
+			conf->dither = atoi(v);
+			for (d = 0; d < DITHER_TYPES; d++)
+				if (strcmp(v, dither_names[d]) == 0)
+					conf->dither = d;
+		}
+		else if (strcmp(p, "poly") == 0)
+			conf->poly = atoi(v) != 0;
+		else if (strcmp(p, "sinebits") == 0)
+			conf->sinebits = atoi(v);
+		else if (strcmp(p, "quarter") == 0)
+			conf->quarter = atoi(v) != 0;
+		else if (strcmp(p, "interp") == 0)
+			conf->interp = atoi(v) != 0;
+		else if (strcmp(p, "combine") == 0)
+			conf->combine = atoi(v) != 0;
+		else if (strcmp(p, "cwg") == 0)
+			conf->cwg = atof(v);
+		else if (strcmp(p, "cwb") == 0)
+			conf->cwb = atof(v);
+		else if (strcmp(p, "cal") == 0)
+			conf->cal = v;
+		else if (strcmp(p, "share") == 0)
+			conf->share = atoi(v);
+		else if (strcmp(p, "tune") == 0)
+			conf->tune = atoi(v);
+		else if (strcmp(p, "snap") == 0)
+			conf->snap = atof(v);
+		else if (strcmp(p, "ns") == 0)
+			conf->ns = atoi(v);
+		else if (strcmp(p, "sim") == 0)
+			conf->sim = atoi(v);
+		else if (strcmp(p, "seed") == 0)
+			conf->seed = strtoull(v, NULL, 0);
+		else if (strcmp(p, "threads") == 0)
+			conf->threads = atoi(v);
+		else if (strcmp(p, "noise") == 0)
+			conf->noise = atof(v);
+		else if (strcmp(p, "nlevel") == 0)
+			conf->nlevel = atof(v);
+		else if (strcmp(p, "tones") == 0)
+			conf->tones = atoi(v);
+		else if (strcmp(p, "spacing") == 0)
+			conf->spacing = atof(v);
+		else if (strcmp(p, "slots") == 0)
+			conf->slots = atoi(v);
+		else if (strcmp(p, "out") == 0)
+			conf->out = v;
+		else if (strcmp(p, "bench") == 0)
+			conf->bench = atoi(v);
 		else if (strcmp(p, "s") == 0)
 			conf->s = v;
+		else if (strcmp(p, "m") == 0) {
+			if (conf->nm < MAX_MSGS)
+				conf->m[conf->nm++] = v;
+		}
+		else if (strcmp(p, "rotate") == 0)
+			conf->rotate = atoi(v);
+		else if (strcmp(p, "duty") == 0) {
+			if (conf->nduty < MAX_FREQS)
+				conf->duty[conf->nduty++] = atof(v);
+		}
 		else if (strcmp(p, "f") == 0) {
 			if (conf->nf < MAX_FREQS) {
 				conf->f[conf->nf] = atof(v);
@@ -259,41 +3527,174 @@ int main(int argc, char *argv[])
 		}
 		else FAIL("Unknown configuration parameter %s\n", p);
 	}
+	if (conf->synccal) {
+		if (conf->nf == 0 || conf->capfs <= 0)
+			FAIL("synccal needs f and capfs\n");
+		sync_cal(conf);
+		goto end;
+	}
+	/* Encode all messages once, so nothing is left to do at the start
+	 * of a transmission but to pick one */
+	if (conf->nm > 0) {
+		unsigned k;
+		tx->msgs = malloc(conf->nm * WSPR_MAX_PARTS * sizeof(*tx->msgs));
+		for (k = 0; k < conf->nm; k++) {
+			int n = wspr_encode_message(conf->m[k], tx->msgs + tx->nmsgs);
+			if (n < 0)
+				FAIL("Could not encode message %s\n", conf->m[k]);
+			INFO("Message %s in %d transmission%s\n", conf->m[k], n, n > 1 ? "s" : "");
+			tx->nmsgs += n;
+		}
+		conf->s = tx->msgs[0];
+	}
 	i = strlen(conf->s);
-	if (i != WSPR_LEN)
+	if (i != WSPR_LEN && !conf->sim && !conf->tune && conf->noise == 0 && conf->tones == 0)
 		FAIL("Please give %d symbols (%d given)\n", WSPR_LEN, i);
 	if (conf->nf == 0)
 		FAIL("Please give at least one center frequency\n");
+	if (conf->ch < 1 || conf->ch > 3)
+		FAIL("Number of outputs must be between 1 and 3\n");
+	if ((unsigned char)conf->dither >= DITHER_TYPES)
+		FAIL("Unknown dither type\n");
+	if (conf->sinebits != 0 && (conf->sinebits < SINE_BITS_MIN || conf->sinebits > SINE_BITS_MAX))
+		FAIL("Sine table bits must be between %d and %d\n", SINE_BITS_MIN, SINE_BITS_MAX);
+	if (conf->noise > conf->fs / 8)
+		FAIL("Noise bandwidth must be at most fs/8\n");
+	if (conf->noise > 0 && (conf->tune || conf->ns > 0))
+		FAIL("Noise cannot be combined with tune or ns\n");
+	if (conf->tones > MAX_TONES)
+		FAIL("At most %d tones are supported\n", MAX_TONES);
+	if (conf->tones > 0 && (conf->tune || conf->ns > 0 || conf->noise > 0))
+		FAIL("Tones cannot be combined with tune, ns or noise\n");
+	if (conf->bandfs && (conf->tune || conf->ns > 0 || conf->noise > 0 || conf->tones > 0))
+		FAIL("bandfs cannot be combined with tune, ns, noise or tones\n");
+	if (conf->bandfs && conf->out)
+		FAIL("bandfs cannot be used with out, since a file has one sample rate\n");
+	if (conf->stop && (conf->tune || conf->noise > 0 || conf->tones > 0))
+		FAIL("stop cannot be combined with continuous signals\n");
+	if (conf->combine && (conf->ns > 0 || conf->noise > 0 || conf->tones > 0))
+		FAIL("combine cannot be combined with ns, noise or tones\n");
+	if ((conf->df1 != 0 || conf->df2 != 0 || conf->pstep1 != 0 || conf->pstep2 != 0 || conf->pfile) &&
+	    (conf->ns > 0 || conf->noise > 0 || conf->tones > 0 || conf->combine))
+		FAIL("df, pstep and pfile cannot be combined with ns, noise, tones or combine\n");
+	for (i = 0; i < (int)conf->nduty; i++)
+		if (conf->duty[i] < 0 || conf->duty[i] > 100)
+			FAIL("Duty must be between 0 and 100 %%\n");
+	if (conf->nduty && (conf->tune || conf->noise > 0 || conf->tones > 0))
+		FAIL("duty cannot be combined with continuous signals\n");
+	if (conf->sync && conf->bandfs)
+		FAIL("sync cannot be combined with bandfs, since the timeline needs one sample rate\n");
+	if (conf->pfile && tx_load_phases(tx, conf->pfile) == 0)
+		FAIL("Could not read phase shifts from %s\n", conf->pfile);
+	if (conf->steer && (conf->tune || conf->ns > 0 || conf->noise > 0 || conf->tones > 0 || conf->combine))
+		FAIL("steer cannot be combined with tune, ns, noise, tones or combine\n");
+	if (conf->steer) {
+		unsigned dev = conf->steerdev >= 0 ? (unsigned)conf->steerdev : conf->id;
+		if (tx_load_steer(tx, conf->steer, dev) == 0)
+			FAIL("Could not read steering table for adapter %u from %s\n", dev, conf->steer);
+		INFO("Steering table of %u lines over %u slots\n", tx->nsteer, tx->steer_slots);
+	}
+	if (conf->combine && (conf->cwg <= 1 || conf->cwb <= conf->cwg))
+		FAIL("Combined DAC weights must satisfy 1 < cwg < cwb\n");
+	if (conf->combine) {
+		conf->ch = 3;
+		conf->p1 = conf->p2 = 0;
+		tx->comb = combine_init(conf->cwg, conf->cwb, conf->cal);
+		if (tx->comb == NULL)
+			FAIL("Could not read 256 lines of calibration from %s\n", conf->cal);
+		INFO("Combined DAC with steps of 1/%g of R\n", conf->cwb);
+	}
+	for (i = 0; i < (int)conf->nf; i++)
+		conf->bfs[i] = conf->bandfs ? band_fs(conf->f[i], conf->fs) : conf->fs;
+
+	/* Before any thread is started, so that the signals only come
+	 * through the event loop */
+	if (!conf->out && !conf->bench) {
+		sigset_t set;
+		tx_loop_signals(&set);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	}
+	tx_prepare(tx, conf);
+	if (conf->nduty) {
+		struct timespec tp;
+		clock_gettime(CLOCK_REALTIME, &tp);
+		/* A file is reproducible, the air is not */
+		sched_init(&sc, conf, conf->out ? conf->seed : conf->seed ^ (uint64_t)tp.tv_nsec << 20 ^ tp.tv_sec);
+		tx->sched = 1;
+	}
+
+	if (conf->bench) {
+		conf->fs_exact = (1.0 + 1e-6 * conf->ppm) * conf->bfs[0];
+		tx_init(tx, conf);
+		tx_bench(tx, conf->bench);
+		goto end;
+	}
 
 	signal(SIGINT, sighandler);
 
+	if (conf->out) {
+		FILE *f = strcmp(conf->out, "-") == 0 ? stdout : fopen(conf->out, "wb");
+		if (f == NULL)
+			FAIL("Opening %s failed\n", conf->out);
+		/* The file is at exactly the given sample rate */
+		conf->fs_exact = conf->fs;
+		tx_init(tx, conf);
+		if (tx_file(tx, f, conf->slots, conf->nduty ? &sc : NULL) < 0)
+			INFO("Writing %s failed\n", conf->out);
+		if (conf->nduty)
+			sched_stats(&sc, tx);
+		if (f != stdout)
+			fclose(f);
+		goto end;
+	}
+
+	if (tx_loop_init(&loop) < 0)
+		FAIL("Setting up the event loop failed\n");
 	if (fl2k_open(&fl, conf->id) < 0)
 		FAIL("Opening FL2K failed\n");
 
 	/* The FL2K API is a bit strange:
 	 * fl2k_start_tx has to be called before fl2k_set_sample_rate
-	 * in order to work. */
+	 * in order to work. Until tx_init is done with the exact rate,
+	 * the callback sends the idle buffer from tx_prepare. */
+	struct timespec t_start, t_init;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
 	if (fl2k_start_tx(fl, tx_callback, tx, 2) < 0)
 		FAIL("Starting FL2K transmission failed\n");
 
-	if (fl2k_set_sample_rate(fl, (uint32_t)conf->fs) < 0)
+	/* Start at the rate of the first band */
+	if (fl2k_set_sample_rate(fl, (uint32_t)conf->bfs[0]) < 0)
 		FAIL("Setting FL2K sample rate failed\n");
 
 	uint32_t fs_r = fl2k_get_sample_rate(fl);
 	conf->fs_exact = (1.0 + 1e-6 * conf->ppm) * fs_r;
 	INFO("Reported exact sample rate: %lu, corrected: %.1f\n", (long unsigned)fs_r, conf->fs_exact);
 	tx_init(tx, conf);
+	tx->streaming = 1;
+	clock_gettime(CLOCK_MONOTONIC, &t_init);
+	/* Wait for the first buffer to report the startup time */
+	while (__atomic_load_n(&tx->callbacks, __ATOMIC_ACQUIRE) == 0 && running)
+		tx_loop_poll(&loop, tx, NULL, 1);
+	INFO("First samples requested after %.3f s, transmitter ready after %.3f s\n",
+		(tx->first_callback.tv_sec - t_start.tv_sec) + 1e-9 * (tx->first_callback.tv_nsec - t_start.tv_nsec),
+		(t_init.tv_sec - t_start.tv_sec) + 1e-9 * (t_init.tv_nsec - t_start.tv_nsec));
 
 	INFO("Started transmitting\n");
-	while (running)
-		pause();
+	tx_run(tx, conf, fl, conf->nduty ? &sc : NULL, &loop);
 	INFO("Stopping transmitting\n");
-	fl2k_stop_tx(fl);
+	if (tx->streaming) {
+		tx_drain(tx);
+		fl2k_stop_tx(fl);
+	}
+	if (conf->nduty)
+		sched_stats(&sc, tx);
 end:
 	if (fl != NULL) {
 		INFO("Closing FL2K\n");
 		fl2k_close(fl);
 	}
+	if (loop.ep >= 0)
+		tx_loop_close(&loop);
 	INFO("Exiting\n");
 	return 0;
 }
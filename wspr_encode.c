@@ -0,0 +1,348 @@
+/*
+ * WSPR message encoding
+ *
+ * Copyright (C) 2019 Tatu Peltola
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* C version of wspr_encode.py, which is based on SM0YSR's wspr-tools,
+ * so that messages can be encoded inside the transmitter. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "wspr_encode.h"
+
+static const uint8_t wspr_sync[WSPR_LEN] = {
+	1,1,0,0,0,0,0,0,1,0,0,0,1,1,1,0,0,0,1,0,0,1,0,1,1,1,
+	1,0,0,0,0,0,0,0,1,0,0,1,0,1,0,0,
+	0,0,0,0,1,0,1,1,0,0,1,1,0,1,0,0,0,1,1,0,1,0,0,0,0,1,
+	1,0,1,0,1,0,1,0,1,0,0,1,0,0,1,0,
+	1,1,0,0,0,1,1,0,1,0,1,0,0,0,1,0,0,0,0,0,1,0,0,1,0,0,
+	1,1,1,0,1,1,0,0,1,1,0,1,0,0,0,1,
+	1,1,0,0,0,0,0,1,0,1,0,0,1,1,0,0,0,0,0,0,0,1,1,0,1,0,
+	1,1,0,0,0,1,1,0,0,0
+};
+
+/* Index of a character in the alphabet 0-9, A-Z, space */
+static int wspr_char(char c)
+{
+	c = toupper((unsigned char)c);
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 10;
+	if (c == ' ')
+		return 36;
+	return -1;
+}
+
+/* Pack a callsign of up to 6 characters into 28 bits */
+static int wspr_pack_call(const char *callsign, uint32_t *n)
+{
+	char call[7] = "      ";
+	int c[6], i;
+	size_t len = strlen(callsign);
+
+	/* The third character has to be the digit */
+	if (len >= 3 && !isdigit((unsigned char)callsign[2])) {
+		if (len > 5)
+			return -1;
+		memcpy(call + 1, callsign, len);
+	} else {
+		if (len > 6)
+			return -1;
+		memcpy(call, callsign, len);
+	}
+	for (i = 0; i < 6; i++)
+		if ((c[i] = wspr_char(call[i])) < 0)
+			return -1;
+	if (c[1] >= 36 || c[2] >= 10 || c[3] < 10 || c[4] < 10 || c[5] < 10)
+		return -1;
+	*n = c[0];
+	*n = 36 * *n + c[1];
+	*n = 10 * *n + c[2];
+	*n = 27 * *n + (c[3]-10);
+	*n = 27 * *n + (c[4]-10);
+	*n = 27 * *n + (c[5]-10);
+	return 0;
+}
+
+/* Power rounded to the nearest level ending in 0, 3 or 7 dBm */
+static int wspr_dbm(int dbm)
+{
+	static const int corr[10] = { 0, -1, 1, 0, -1, 2, 1, 0, -1, 1 };
+	if (dbm < 0 || dbm > 60)
+		return -1;
+	return dbm + corr[dbm % 10];
+}
+
+/* Pack callsign, locator and power into 50 bits, MSB first */
+static int wspr_pack(const char *callsign, const char *locator, int dbm, uint64_t *n)
+{
+	int l[4], i;
+	uint32_t n_callsign, n_locator;
+
+	if (wspr_pack_call(callsign, &n_callsign) < 0)
+		return -1;
+	if (strlen(locator) != 4)
+		return -1;
+	for (i = 0; i < 4; i++)
+		l[i] = wspr_char(locator[i]);
+	if (l[0] < 10 || l[0] > 27 || l[1] < 10 || l[1] > 27 ||
+	    l[2] < 0 || l[2] > 9 || l[3] < 0 || l[3] > 9)
+		return -1;
+	l[0] -= 10;
+	l[1] -= 10;
+	n_locator = (179 - 10*l[0] - l[2])*180 + 10*l[1] + l[3];
+
+	if ((dbm = wspr_dbm(dbm)) < 0)
+		return -1;
+	*n = ((uint64_t)n_callsign << (15+7)) | (n_locator << 7) | (dbm + 64);
+	return 0;
+}
+
+/* Index of a character of a prefix or suffix, as in WSJT */
+static int wspr_fix_char(char c, int other)
+{
+	int i = wspr_char(c);
+	return i < 0 || i == 36 ? other : i;
+}
+
+/* Pack a compound callsign with a prefix of 1-3 characters or
+ * a suffix of one character or two digits and power into 50 bits.
+ * The power field also tells the type and whether the prefix or
+ * suffix overflowed its 15 bits. */
+static int wspr_pack2(const char *callsign, int dbm, uint64_t *n)
+{
+	char base[7];
+	const char *slash = strchr(callsign, '/');
+	size_t len = strlen(callsign), pos;
+	uint32_t n_callsign, ng, nadd = 0;
+	int i;
+
+	if (slash == NULL || strchr(slash + 1, '/') != NULL)
+		return -1;
+	pos = slash - callsign;
+	if (len - pos - 1 <= 2 && len - pos - 1 >= 1) {
+		/* Suffix */
+		if (pos > 6)
+			return -1;
+		memcpy(base, callsign, pos);
+		base[pos] = '\0';
+		if (len - pos - 1 == 1) {
+			ng = 60000 - 32768 + wspr_fix_char(slash[1], 38);
+		} else {
+			if (!isdigit((unsigned char)slash[1]) || !isdigit((unsigned char)slash[2]))
+				return -1;
+			ng = 60000 + 26 + 10 * (slash[1] - '0') + (slash[2] - '0');
+		}
+		nadd = 1;
+	} else {
+		/* Prefix, padded to 3 characters from the left */
+		char pfx[3] = { ' ', ' ', ' ' };
+		if (pos < 1 || pos > 3 || len - pos - 1 > 6)
+			return -1;
+		memcpy(pfx + 3 - pos, callsign, pos);
+		strcpy(base, slash + 1);
+		ng = 0;
+		for (i = 0; i < 3; i++) {
+			if (pfx[i] != ' ' && wspr_char(pfx[i]) < 0)
+				return -1;
+			ng = 37 * ng + wspr_fix_char(pfx[i], 36);
+		}
+		if (ng >= 32768) {
+			ng -= 32768;
+			nadd = 1;
+		}
+	}
+	if (wspr_pack_call(base, &n_callsign) < 0 || (dbm = wspr_dbm(dbm)) < 0)
+		return -1;
+	/* The field is 22 bits, which wraps a two digit suffix around */
+	*n = ((uint64_t)n_callsign << 22) | ((128 * ng + dbm + 1 + nadd + 64) & 0x3FFFFF);
+	return 0;
+}
+
+/* Bob Jenkins' lookup3 hashlittle, which WSJT uses for callsigns */
+#define WSPR_ROT(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+static uint32_t wspr_hash(const char *key, size_t len, uint32_t init)
+{
+	const uint8_t *k = (const uint8_t *)key;
+	uint32_t a, b, c;
+	a = b = c = 0xdeadbeef + (uint32_t)len + init;
+	while (len > 12) {
+		a += k[0] | (uint32_t)k[1] << 8 | (uint32_t)k[2] << 16 | (uint32_t)k[3] << 24;
+		b += k[4] | (uint32_t)k[5] << 8 | (uint32_t)k[6] << 16 | (uint32_t)k[7] << 24;
+		c += k[8] | (uint32_t)k[9] << 8 | (uint32_t)k[10] << 16 | (uint32_t)k[11] << 24;
+		a -= c; a ^= WSPR_ROT(c, 4); c += b;
+		b -= a; b ^= WSPR_ROT(a, 6); a += c;
+		c -= b; c ^= WSPR_ROT(b, 8); b += a;
+		a -= c; a ^= WSPR_ROT(c, 16); c += b;
+		b -= a; b ^= WSPR_ROT(a, 19); a += c;
+		c -= b; c ^= WSPR_ROT(b, 4); b += a;
+		len -= 12;
+		k += 12;
+	}
+	switch (len) {
+	case 12: c += (uint32_t)k[11] << 24; /* fall through */
+	case 11: c += (uint32_t)k[10] << 16; /* fall through */
+	case 10: c += (uint32_t)k[9] << 8; /* fall through */
+	case 9: c += k[8]; /* fall through */
+	case 8: b += (uint32_t)k[7] << 24; /* fall through */
+	case 7: b += (uint32_t)k[6] << 16; /* fall through */
+	case 6: b += (uint32_t)k[5] << 8; /* fall through */
+	case 5: b += k[4]; /* fall through */
+	case 4: a += (uint32_t)k[3] << 24; /* fall through */
+	case 3: a += (uint32_t)k[2] << 16; /* fall through */
+	case 2: a += (uint32_t)k[1] << 8; /* fall through */
+	case 1: a += k[0]; break;
+	case 0: return c;
+	}
+	c ^= b; c -= WSPR_ROT(b, 14);
+	a ^= c; a -= WSPR_ROT(c, 11);
+	b ^= a; b -= WSPR_ROT(a, 25);
+	c ^= b; c -= WSPR_ROT(b, 16);
+	a ^= c; a -= WSPR_ROT(c, 4);
+	b ^= a; b -= WSPR_ROT(a, 14);
+	c ^= b; c -= WSPR_ROT(b, 24);
+	return c;
+}
+
+/* Pack the 15-bit hash of a callsign, 6-character locator and power
+ * into 50 bits. The locator is rotated by one character and packed
+ * like a callsign. */
+static int wspr_pack3(const char *callsign, const char *locator, int dbm, uint64_t *n)
+{
+	char loc[7];
+	uint32_t n_loc, ih;
+	int i;
+
+	if (strlen(locator) != 6 || strlen(callsign) > 12)
+		return -1;
+	for (i = 0; i < 6; i++)
+		loc[i] = toupper((unsigned char)locator[(i + 1) % 6]);
+	loc[6] = '\0';
+	if (wspr_pack_call(loc, &n_loc) < 0 || (dbm = wspr_dbm(dbm)) < 0)
+		return -1;
+	ih = wspr_hash(callsign, strlen(callsign), 146) & 32767;
+	*n = ((uint64_t)n_loc << 22) | ((128 * ih - (dbm + 1) + 64) & 0x3FFFFF);
+	return 0;
+}
+
+static int wspr_parity(uint32_t x)
+{
+	return __builtin_parity(x);
+}
+
+/* Convolutional code and interleaving of 50 packed bits */
+static void wspr_symbols(uint64_t n, char *symbols)
+{
+	uint8_t conv[WSPR_LEN];
+	uint32_t r = 0;
+	int i, s_i = 0;
+
+	/* Convolutional code over the 50 bits and 31 zero bits of padding */
+	for (i = 0; i < 81; i++) {
+		r = (r << 1) | (i < 50 ? (n >> (49 - i)) & 1 : 0);
+		conv[2*i]   = wspr_parity(r & 0xF2D05351);
+		conv[2*i+1] = wspr_parity(r & 0xE4613C47);
+	}
+
+	/* Interleave by bit reversed addresses */
+	for (i = 0; i < 256; i++) {
+		int d_i = i;
+		d_i = (d_i & 0xF0) >> 4 | (d_i & 0x0F) << 4;
+		d_i = (d_i & 0xCC) >> 2 | (d_i & 0x33) << 2;
+		d_i = (d_i & 0xAA) >> 1 | (d_i & 0x55) << 1;
+		if (d_i < WSPR_LEN)
+			symbols[d_i] = '0' + wspr_sync[d_i] + 2 * conv[s_i++];
+	}
+	symbols[WSPR_LEN] = '\0';
+}
+
+int wspr_encode(const char *callsign, const char *locator, int dbm, char *symbols)
+{
+	uint64_t n;
+	if (wspr_pack(callsign, locator, dbm, &n) < 0)
+		return -1;
+	wspr_symbols(n, symbols);
+	return 0;
+}
+
+int wspr_encode_type2(const char *callsign, int dbm, char *symbols)
+{
+	char call[16];
+	size_t i, len = strlen(callsign);
+	uint64_t n;
+	if (len >= sizeof(call))
+		return -1;
+	for (i = 0; i <= len; i++)
+		call[i] = toupper((unsigned char)callsign[i]);
+	if (wspr_pack2(call, dbm, &n) < 0)
+		return -1;
+	wspr_symbols(n, symbols);
+	return 0;
+}
+
+int wspr_encode_type3(const char *callsign, const char *locator, int dbm, char *symbols)
+{
+	char call[16];
+	size_t i, len = strlen(callsign);
+	uint64_t n;
+	if (len >= sizeof(call))
+		return -1;
+	for (i = 0; i <= len; i++)
+		call[i] = toupper((unsigned char)callsign[i]);
+	if (wspr_pack3(call, locator, dbm, &n) < 0)
+		return -1;
+	wspr_symbols(n, symbols);
+	return 0;
+}
+
+/* As WSJT-X does: a compound callsign is sent as Type 2 and, with a
+ * 6-character locator, Type 3, and a plain callsign with a 6-character
+ * locator as Type 1 with its first 4 characters and Type 3. */
+int wspr_encode_message(const char *msg, char symbols[][WSPR_LEN + 1])
+{
+	char call[16], loc[8];
+	int dbm, n;
+	if (sscanf(msg, "%15s %7s %d", call, loc, &dbm) == 3) {
+		size_t len = strlen(loc);
+		if (len != 4 && len != 6)
+			return -1;
+		if (strchr(call, '/') != NULL) {
+			if (wspr_encode_type2(call, dbm, symbols[0]) < 0)
+				return -1;
+			n = 1;
+		} else {
+			char loc4[5];
+			memcpy(loc4, loc, 4);
+			loc4[4] = '\0';
+			if (wspr_encode(call, loc4, dbm, symbols[0]) < 0)
+				return -1;
+			n = 1;
+		}
+		if (len == 6) {
+			if (wspr_encode_type3(call, loc, dbm, symbols[n]) < 0)
+				return -1;
+			n++;
+		}
+		return n;
+	}
+	if (sscanf(msg, "%15s %d", call, &dbm) == 2 && strchr(call, '/') != NULL)
+		return wspr_encode_type2(call, dbm, symbols[0]) < 0 ? -1 : 1;
+	return -1;
+}
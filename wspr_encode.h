@@ -0,0 +1,47 @@
+/*
+ * WSPR message encoding
+ *
+ * Copyright (C) 2019 Tatu Peltola
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WSPR_ENCODE_H
+#define WSPR_ENCODE_H
+
+#define WSPR_LEN 162
+#define WSPR_MAX_PARTS 2 // Transmissions of one message
+
+/* Encode a message with callsign, 4-character locator and power (dBm)
+ * into WSPR symbols, written to symbols as a string of WSPR_LEN
+ * numbers between 0 and 3, the same format as given by wspr_encode.py.
+ * Returns 0 on success or -1 if the message cannot be encoded. */
+int wspr_encode(const char *callsign, const char *locator, int dbm, char *symbols);
+
+/* Type 2 message: compound callsign with a prefix of 1-3 characters
+ * or a suffix of one character or two digits (e.g. PJ4/K1ABC, K1ABC/P)
+ * and power, without locator */
+int wspr_encode_type2(const char *callsign, int dbm, char *symbols);
+
+/* Type 3 message: hash of the callsign, which may be compound,
+ * 6-character locator and power */
+int wspr_encode_type3(const char *callsign, const char *locator, int dbm, char *symbols);
+
+/* Encode a message given as text "CALL LOCATOR DBM" or "CALL DBM"
+ * into the transmissions needed to send it, 1 or 2 of them, written
+ * to symbols in the order to send. Returns their number, or -1 if
+ * the message cannot be encoded. */
+int wspr_encode_message(const char *msg, char symbols[][WSPR_LEN + 1]);
+
+#endif